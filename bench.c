@@ -0,0 +1,540 @@
+/*
+ * Benchmark for gzip and gunzip
+ * Generates the same corpora on every run, compresses and decompresses
+ * each with the built programs and reports throughput, ratio, peak
+ * memory and cycles per byte
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Cycles come from the time stamp counter where there is one */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_TSC
+#endif
+
+#define PIECE           65536L  /* Size of each part of the mixed corpus */
+#define MAX_RUNS        20
+
+/* Corpus kinds */
+#define C_TEXT          0
+#define C_BINARY        1
+#define C_RANDOM        2
+#define C_ZEROS         3
+#define C_MIXED         4
+#define C_PERIODIC      5
+#define NCORPORA        6
+
+static char *corpus_name[NCORPORA] = {
+    "text", "binary", "random", "zeros", "mixed", "periodic"
+};
+
+/*
+ * Inputs that once broke gzip, round-tripped before anything is timed.
+ * This much of the text corpus ends a block with gzip's output buffer
+ * exactly full.
+ */
+static struct {
+    int kind;
+    long size;
+    char *level;
+} regressions[] = {
+    { C_TEXT,   985476L,    "-6" }
+};
+#define NREGRESSIONS    (sizeof(regressions) / sizeof(regressions[0]))
+
+/* Timing of one program run: the best of the runs made */
+struct timing {
+    double seconds;
+    double cycles;
+    long maxrss;                /* Peak resident set in KB */
+};
+
+static unsigned long seed;
+
+/*
+ * xorshift32, so the corpora come out the same on every host
+ */
+static unsigned long next_random(void)
+{
+    seed ^= (seed << 13) & 0xffffffffL;
+    seed ^= seed >> 17;
+    seed ^= (seed << 5) & 0xffffffffL;
+    return seed;
+}
+
+static char *words[] = {
+    "the", "request", "from", "connection", "user", "session", "to",
+    "accepted", "closed", "error", "timeout", "of", "in", "cache", "miss",
+    "hit", "write", "read", "file", "block", "queue", "worker", "started",
+    "finished", "retry", "after", "bytes", "ms", "and", "server", "client",
+    "config", "reloaded", "denied", "permission", "for", "with", "index"
+};
+#define NWORDS  (sizeof(words) / sizeof(words[0]))
+
+static char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+
+/*
+ * Log lines: timestamps, hosts, levels and a skewed vocabulary, like
+ * the text most gzip files hold
+ */
+static long make_text(unsigned char *buf, long size)
+{
+    long n = 0, t = 0;
+    int k, nw;
+    char line[512];
+    
+    while (n < size) {
+        t += next_random() % 1000;
+        k = sprintf(line, "2025-03-%02ld %02ld:%02ld:%02ld.%03ld host%02lu %s [%lu]:",
+                    1 + t / 86400000L % 28, t / 3600000L % 24,
+                    t / 60000L % 60, t / 1000 % 60, t % 1000,
+                    next_random() % 16, levels[next_random() % 6],
+                    1000 + next_random() % 50);
+        for (nw = 4 + next_random() % 12; nw > 0; nw--) {
+            /* Low indexes come up far more often */
+            k += sprintf(line + k, " %s",
+                         words[next_random() % (next_random() % NWORDS + 1)]);
+            if (next_random() % 8 == 0)
+                k += sprintf(line + k, " %lu", next_random() % 100000);
+        }
+        line[k++] = '\n';
+        if (k > size - n)
+            k = (int)(size - n);
+        memcpy(buf + n, line, k);
+        n += k;
+    }
+    return n;
+}
+
+/*
+ * Fixed-size little-endian records with counters, small deltas, a few
+ * type codes and padding, like tables in executables and databases
+ */
+static long make_binary(unsigned char *buf, long size)
+{
+    unsigned long id = 0, stamp = 0, v;
+    long n;
+    int i;
+    
+    for (n = 0; n + 16 <= size; n += 16) {
+        id++;
+        stamp += next_random() % 64;
+        v = next_random();
+        for (i = 0; i < 4; i++) {
+            buf[n + i] = (unsigned char)(id >> (8 * i));
+            buf[n + 4 + i] = (unsigned char)(stamp >> (8 * i));
+        }
+        buf[n + 8] = (unsigned char)(v % 7);
+        buf[n + 9] = 0;
+        buf[n + 10] = (unsigned char)(v >> 8);
+        buf[n + 11] = (unsigned char)((v >> 16) % 4);
+        memset(buf + n + 12, (v >> 24) % 16 == 0 ? 0xff : 0, 4);
+    }
+    memset(buf + n, 0, size - n);
+    return size;
+}
+
+static long make_random(unsigned char *buf, long size)
+{
+    long n;
+    
+    for (n = 0; n < size; n++)
+        buf[n] = (unsigned char)(next_random() >> 11);
+    return size;
+}
+
+/*
+ * Byte ramps and a repeated 4KB random block in alternate pieces.  Every
+ * byte value comes up about as often as in random data, yet nearly
+ * every string repeats one a short way back.
+ */
+static long make_periodic(unsigned char *buf, long size)
+{
+    unsigned char block[4096];
+    unsigned int step;
+    long n, i, len;
+    int ramp = 1;
+    
+    make_random(block, (long)sizeof(block));
+    for (n = 0; n < size; n += len) {
+        len = (size - n < PIECE) ? size - n : PIECE;
+        if (ramp) {
+            /* An odd step visits all 256 values before repeating */
+            step = (unsigned int)(next_random() % 128) * 2 + 1;
+            for (i = 0; i < len; i++)
+                buf[n + i] = (unsigned char)(i * step);
+        }
+        else {
+            for (i = 0; i < len; i++)
+                buf[n + i] = block[i % sizeof(block)];
+        }
+        ramp = !ramp;
+    }
+    return size;
+}
+
+/*
+ * Pieces of every other kind in turn, in the spirit of the Silesia
+ * corpus
+ */
+static long make_mixed(unsigned char *buf, long size)
+{
+    long n, len;
+    int kind = 0;
+    
+    for (n = 0; n < size; n += len) {
+        len = (size - n < PIECE) ? size - n : PIECE;
+        switch (kind) {
+        case C_TEXT:    make_text(buf + n, len);    break;
+        case C_BINARY:  make_binary(buf + n, len);  break;
+        case C_RANDOM:  make_random(buf + n, len);  break;
+        default:        memset(buf + n, 0, len);    break;
+        }
+        /* Text and binary twice as often as the rest */
+        kind = (int)(next_random() % 6);
+        if (kind > C_ZEROS)
+            kind -= 4;
+    }
+    return size;
+}
+
+static int write_corpus(char *path, int kind, long size)
+{
+    unsigned char *buf;
+    FILE *fp;
+    int ok;
+    
+    buf = (unsigned char *)malloc((size_t)size);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    seed = 2463534242UL + kind;
+    switch (kind) {
+    case C_TEXT:    make_text(buf, size);       break;
+    case C_BINARY:  make_binary(buf, size);     break;
+    case C_RANDOM:  make_random(buf, size);     break;
+    case C_ZEROS:   memset(buf, 0, size);       break;
+    case C_PERIODIC: make_periodic(buf, size);  break;
+    default:        make_mixed(buf, size);      break;
+    }
+    
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror(path);
+        free(buf);
+        return -1;
+    }
+    ok = fwrite(buf, 1, (size_t)size, fp) == (size_t)size;
+    if (fclose(fp) != 0 || !ok) {
+        perror(path);
+        ok = 0;
+    }
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+#ifdef HAVE_TSC
+static double read_tsc(void)
+{
+    unsigned int lo, hi;
+    
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return (double)hi * 4294967296.0 + lo;
+}
+#endif
+
+/*
+ * Run argv with standard input from in and standard output to out,
+ * discarding its messages.  Returns -1 if it cannot be run or fails.
+ */
+static int run(char **argv, char *in, char *out, struct timing *t)
+{
+    struct timeval start, end;
+    struct rusage ru;
+    double c0 = 0;
+    int pid, status, fd;
+    
+    gettimeofday(&start, NULL);
+#ifdef HAVE_TSC
+    c0 = read_tsc();
+#endif
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        if ((fd = open(in, O_RDONLY)) < 0 || dup2(fd, 0) < 0)
+            _exit(127);
+        close(fd);
+        if ((fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+            dup2(fd, 1) < 0)
+            _exit(127);
+        close(fd);
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, 2);
+            close(fd);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) != pid)
+        return -1;
+#ifdef HAVE_TSC
+    t->cycles = read_tsc() - c0;
+#endif
+    gettimeofday(&end, NULL);
+    t->seconds = (end.tv_sec - start.tv_sec) +
+                 (end.tv_usec - start.tv_usec) / 1e6;
+    t->maxrss = ru.ru_maxrss;
+    
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: %s exited with status %d\n", argv[0],
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run argv runs times, keeping the fastest time and the largest peak
+ * memory
+ */
+static int best_of(int runs, char **argv, char *in, char *out,
+                   struct timing *best)
+{
+    struct timing t;
+    int i;
+    
+    memset(best, 0, sizeof(*best));
+    for (i = 0; i < runs; i++) {
+        memset(&t, 0, sizeof(t));
+        if (run(argv, in, out, &t) != 0)
+            return -1;
+        if (i == 0 || t.seconds < best->seconds) {
+            best->seconds = t.seconds;
+            best->cycles = t.cycles;
+        }
+        if (t.maxrss > best->maxrss)
+            best->maxrss = t.maxrss;
+    }
+    return 0;
+}
+
+/*
+ * Compare two files byte for byte
+ */
+static int same_file(char *a, char *b)
+{
+    FILE *fa, *fb;
+    int ca, cb;
+    
+    fa = fopen(a, "rb");
+    fb = fopen(b, "rb");
+    if (fa == NULL || fb == NULL) {
+        if (fa) fclose(fa);
+        if (fb) fclose(fb);
+        return 0;
+    }
+    do {
+        ca = getc(fa);
+        cb = getc(fb);
+    } while (ca == cb && ca != EOF);
+    fclose(fa);
+    fclose(fb);
+    return ca == cb;
+}
+
+static long file_size(char *path)
+{
+    FILE *fp;
+    long size;
+    
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    fseek(fp, 0L, 2);  /* SEEK_END */
+    size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+/*
+ * Check that each of the regression inputs survives the round trip.
+ * Returns -1 if one does not.
+ */
+static int check_regressions(char *dir, char *gzip_prog, char *gunzip_prog)
+{
+    char orig[1024], comp[1024], back[1024];
+    char *gzip_argv[4], *gunzip_argv[3];
+    struct timing t;
+    unsigned int i;
+    int status = 0;
+    
+    gzip_argv[0] = gzip_prog;
+    gzip_argv[2] = "-c";
+    gzip_argv[3] = NULL;
+    gunzip_argv[0] = gunzip_prog;
+    gunzip_argv[1] = "-c";
+    gunzip_argv[2] = NULL;
+    sprintf(orig, "%.900s/bench-check", dir);
+    sprintf(comp, "%.900s/bench-check.gz", dir);
+    sprintf(back, "%.900s/bench-check.out", dir);
+    
+    for (i = 0; i < NREGRESSIONS && status == 0; i++) {
+        gzip_argv[1] = regressions[i].level;
+        if (write_corpus(orig, regressions[i].kind, regressions[i].size) != 0 ||
+            run(gzip_argv, orig, comp, &t) != 0 ||
+            run(gunzip_argv, comp, back, &t) != 0 ||
+            !same_file(orig, back)) {
+            fprintf(stderr, "Error: %ld bytes of the %s corpus at %s did not survive the round trip\n",
+                    regressions[i].size, corpus_name[regressions[i].kind],
+                    regressions[i].level);
+            status = -1;
+        }
+    }
+    unlink(orig);
+    unlink(comp);
+    unlink(back);
+    return status;
+}
+
+static void print_speed(long size, struct timing *t)
+{
+    printf(" %8.1f", t->seconds > 0 ? size / t->seconds / 1e6 : 0.0);
+#ifdef HAVE_TSC
+    printf(" %7.1f", t->cycles / size);
+#else
+    printf(" %7s", "-");
+#endif
+    printf(" %7ld", t->maxrss);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-0..-10] [-n runs] [-s MB] [-d dir] [gzip gunzip]\n",
+            prog);
+    fprintf(stderr, "  -n takes the best of runs timings (default 3)\n");
+    fprintf(stderr, "  -s sets the size of each corpus (default 8MB)\n");
+    fprintf(stderr, "  -d writes the corpora and outputs in dir (default .)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char *gzip_prog = "./gzip", *gunzip_prog = "./gunzip";
+    char *dir = ".";
+    char level[4] = "-6";
+    char orig[1024], comp[1024], back[1024];
+    char *gzip_argv[4], *gunzip_argv[3];
+    struct timing ct, dt;
+    long size = 8L << 20, csize;
+    long total = 0, total_comp = 0;
+    double total_ct = 0, total_dt = 0;
+    int runs = 3;
+    int argn, kind;
+    int status = 0;
+    
+    for (argn = 1; argn < argc && argv[argn][0] == '-'; argn++) {
+        if (argv[argn][1] >= '0' && argv[argn][1] <= '9' &&
+            argv[argn][2] == '\0')
+            level[1] = argv[argn][1];
+        else if (strcmp(argv[argn], "-10") == 0)
+            strcpy(level, "-10");
+        else if (strcmp(argv[argn], "-n") == 0 && argn + 1 < argc) {
+            runs = atoi(argv[++argn]);
+            if (runs < 1 || runs > MAX_RUNS) {
+                fprintf(stderr, "Runs must be 1 to %d\n", MAX_RUNS);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argn], "-s") == 0 && argn + 1 < argc) {
+            size = atol(argv[++argn]) << 20;
+            if (size <= 0) {
+                fprintf(stderr, "Corpus size must be at least 1MB\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argn], "-d") == 0 && argn + 1 < argc)
+            dir = argv[++argn];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - argn == 2) {
+        gzip_prog = argv[argn];
+        gunzip_prog = argv[argn + 1];
+    }
+    else if (argc != argn) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    if (check_regressions(dir, gzip_prog, gunzip_prog) != 0)
+        return 1;
+    
+    /* Both programs stream from standard input to standard output */
+    gzip_argv[0] = gzip_prog;
+    gzip_argv[1] = level;
+    gzip_argv[2] = "-c";
+    gzip_argv[3] = NULL;
+    gunzip_argv[0] = gunzip_prog;
+    gunzip_argv[1] = "-c";
+    gunzip_argv[2] = NULL;
+    
+    printf("gzip %s, %ldMB per corpus, best of %d\n", level, size >> 20, runs);
+    printf("%-8s %7s | %8s %7s %7s | %8s %7s %7s\n", "", "",
+           "gzip", "", "", "gunzip", "", "");
+    printf("%-8s %7s | %8s %7s %7s | %8s %7s %7s\n", "corpus", "ratio",
+           "MB/s", "cyc/B", "RSS KB", "MB/s", "cyc/B", "RSS KB");
+    
+    for (kind = 0; kind < NCORPORA; kind++) {
+        sprintf(orig, "%.900s/bench-%s", dir, corpus_name[kind]);
+        sprintf(comp, "%.900s/bench-%s.gz", dir, corpus_name[kind]);
+        sprintf(back, "%.900s/bench-%s.out", dir, corpus_name[kind]);
+    
+        if (write_corpus(orig, kind, size) != 0 ||
+            best_of(runs, gzip_argv, orig, comp, &ct) != 0 ||
+            best_of(runs, gunzip_argv, comp, back, &dt) != 0) {
+            status = 1;
+            break;
+        }
+        if (!same_file(orig, back)) {
+            fprintf(stderr, "Error: %s did not decompress to the original\n",
+                    comp);
+            status = 1;
+            break;
+        }
+        csize = file_size(comp);
+    
+        printf("%-8s %7.3f |", corpus_name[kind], (double)csize / size);
+        print_speed(size, &ct);
+        printf(" |");
+        print_speed(size, &dt);
+        printf("\n");
+        fflush(stdout);
+    
+        total += size;
+        total_comp += csize;
+        total_ct += ct.seconds;
+        total_dt += dt.seconds;
+        unlink(orig);
+        unlink(comp);
+        unlink(back);
+    }
+    
+    if (status == 0)
+        printf("%-8s %7.3f | %8.1f %7s %7s | %8.1f\n", "all",
+               (double)total_comp / total, total / total_ct / 1e6, "", "",
+               total / total_dt / 1e6);
+    return status;
+}
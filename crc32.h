@@ -0,0 +1,10 @@
+/*
+ * CRC32 shared by gzip and gunzip
+ *
+ * The running value starts at 0xffffffff and is inverted once the
+ * last byte has been added, as in the gzip trailer.  crc32_combine()
+ * takes and returns finished values.
+ */
+
+unsigned long update_crc(unsigned long crc, unsigned char *buf, unsigned int len);
+unsigned long crc32_combine(unsigned long crc1, unsigned long crc2, long len2);
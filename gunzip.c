@@ -6,6 +6,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#ifdef pdp11
+#include <sys/dir.h>            /* 2.11BSD names it struct direct */
+#define dirent direct
+#else
+#include <dirent.h>
+#endif
+
+#include "crc32.h"
+#include "gz.h"
 
 /* GZIP header structure */
 #define GZIP_MAGIC1     0x1f
@@ -30,164 +43,591 @@ static char *os_names[] = {
 #define MAX_BITS        15
 #define MAX_CODES       288
 #define WSIZE           32768U  /* Window size - must be unsigned on 16-bit systems */
+#define MAX_MATCH       258
 
-/* Bit buffer for reading bit-by-bit */
-static unsigned long bitbuf = 0;
-static int bitcount = 0;
-static FILE *infile;
+/*
+ * Output is decoded into a linear buffer: history, then room for new
+ * output, which is written out in one piece when the room runs short.
+ * The PDP-11 keeps the room small to fit its data space; define
+ * SMALLMEM to build that anywhere.
+ */
+#if defined(pdp11) && !defined(SMALLMEM)
+#define SMALLMEM
+#endif
 
-/* Output window for LZ77 decompression */
-static unsigned char *window = NULL;
-static unsigned int wpos = 0;
+#ifdef SMALLMEM
+#define OUTSIZE         (WSIZE + 8192U)
+#else
+#define OUTSIZE         (WSIZE + 1048576U)
+#endif
 
-/* Progress tracking */
-static long compressed_size = 0;
-static long bytes_output = 0;
-static unsigned int progress_counter = 0;
+/* Huffman lookup table parameters */
+#define LEN_ROOT        9       /* Index bits of literal/length primary table */
+#define DIST_ROOT       6       /* Index bits of distance primary table */
+#define CODE_ROOT       7       /* Index bits of code length code table */
+#define LEN_ENOUGH      852     /* Worst case literal/length table entries */
+#define DIST_ENOUGH     592     /* Worst case distance table entries */
+#define CODE_ENOUGH     128     /* Code length codes never exceed 7 bits */
+
+/* Input buffer size */
+#define INBUFSIZ        8192
+
+/* Output between access points in a random-access index */
+#define INDEX_SPAN      1048576L
+
+/* Index file: magic, compressed size, offset of the deflate data, then
+ * one record per access point */
+#define INDEX_MAGIC     "GZI2"
+#define INDEX_LEVEL     6       /* Compression of the stored windows */
+#define INDEX_WINDOW    (WSIZE + 1024L) /* Room for a compressed window */
+
+/* Parallel mode: worker processes, and input segments per worker */
+#define MAX_WORKERS     64
+#define SEGMENTS        4
+#define SEGMENT_MIN     262144L /* Smallest compressed segment */
 
-/* CRC32 table and value */
-static unsigned long crc_table[256];
-static unsigned long crc = 0xffffffffL;
+/* Kinds of input position a segment starts at */
+#define SEG_HEADER      0       /* A gzip member header */
+#define SEG_BLOCK       1       /* The block after a full flush */
+#define SEG_EOF         2       /* End of the gzip data */
+
+/* Bits held by the bit buffer: 64 on LP64 hosts, 32 on the PDP-11 */
+#define BITBUF_BITS     ((int)(sizeof(unsigned long) * 8))
+
+/*
+ * Little-endian hosts with a 64-bit long can refill the bit buffer
+ * with a single unaligned word load.
+ */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__SIZEOF_LONG__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && __SIZEOF_LONG__ == 8
+#define FAST_REFILL
+#endif
+#endif
+
+/* Hosts with mmap() decode regular files straight from a mapping */
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
+
+/* Peek at / consume the next n bits of the bit buffer */
+#define PEEKBITS(n)     ((unsigned int)s->bitbuf & ((1U << (n)) - 1))
+#define DROPBITS(n)     (s->bitbuf >>= (n), s->bitcount -= (n))
+
+/* Huffman table entry */
+struct hentry {
+    unsigned char bits;     /* Code bits to consume, 0 if invalid code */
+    unsigned char sub;      /* Index bits of sub-table, 0 for a symbol */
+    unsigned short val;     /* Symbol, or offset of sub-table */
+};
 
-/* Huffman code structure */
+/*
+ * Huffman decoding table.  The primary table is indexed by the next
+ * root bits of input; codes longer than that point to a sub-table
+ * indexed by the bits that follow.
+ */
 struct huffman {
-    short *count;   /* Number of codes of each length */
-    short *symbol;  /* Symbols in canonical order */
+    const struct hentry *table; /* Primary table followed by sub-tables */
+    int root;               /* Index bits of primary table */
+    int size;               /* Entries available in table */
+};
+
+/*
+ * Tables for the fixed Huffman codes, as build_huffman() makes them from
+ * the code lengths of RFC 1951 3.2.6: 8, 9, 7 and 8 bits for the
+ * literal/length ranges and 5 for every distance.  They are written out
+ * in full so that contexts in any number of threads share them without
+ * setting anything up.
+ */
+static const struct hentry fixed_lentab[1 << LEN_ROOT] = {
+    {7,0,256}, {8,0,80}, {8,0,16}, {8,0,280}, {7,0,272}, {8,0,112}, {8,0,48}, {9,0,192},
+    {7,0,264}, {8,0,96}, {8,0,32}, {9,0,160}, {8,0,0}, {8,0,128}, {8,0,64}, {9,0,224},
+    {7,0,260}, {8,0,88}, {8,0,24}, {9,0,144}, {7,0,276}, {8,0,120}, {8,0,56}, {9,0,208},
+    {7,0,268}, {8,0,104}, {8,0,40}, {9,0,176}, {8,0,8}, {8,0,136}, {8,0,72}, {9,0,240},
+    {7,0,258}, {8,0,84}, {8,0,20}, {8,0,284}, {7,0,274}, {8,0,116}, {8,0,52}, {9,0,200},
+    {7,0,266}, {8,0,100}, {8,0,36}, {9,0,168}, {8,0,4}, {8,0,132}, {8,0,68}, {9,0,232},
+    {7,0,262}, {8,0,92}, {8,0,28}, {9,0,152}, {7,0,278}, {8,0,124}, {8,0,60}, {9,0,216},
+    {7,0,270}, {8,0,108}, {8,0,44}, {9,0,184}, {8,0,12}, {8,0,140}, {8,0,76}, {9,0,248},
+    {7,0,257}, {8,0,82}, {8,0,18}, {8,0,282}, {7,0,273}, {8,0,114}, {8,0,50}, {9,0,196},
+    {7,0,265}, {8,0,98}, {8,0,34}, {9,0,164}, {8,0,2}, {8,0,130}, {8,0,66}, {9,0,228},
+    {7,0,261}, {8,0,90}, {8,0,26}, {9,0,148}, {7,0,277}, {8,0,122}, {8,0,58}, {9,0,212},
+    {7,0,269}, {8,0,106}, {8,0,42}, {9,0,180}, {8,0,10}, {8,0,138}, {8,0,74}, {9,0,244},
+    {7,0,259}, {8,0,86}, {8,0,22}, {8,0,286}, {7,0,275}, {8,0,118}, {8,0,54}, {9,0,204},
+    {7,0,267}, {8,0,102}, {8,0,38}, {9,0,172}, {8,0,6}, {8,0,134}, {8,0,70}, {9,0,236},
+    {7,0,263}, {8,0,94}, {8,0,30}, {9,0,156}, {7,0,279}, {8,0,126}, {8,0,62}, {9,0,220},
+    {7,0,271}, {8,0,110}, {8,0,46}, {9,0,188}, {8,0,14}, {8,0,142}, {8,0,78}, {9,0,252},
+    {7,0,256}, {8,0,81}, {8,0,17}, {8,0,281}, {7,0,272}, {8,0,113}, {8,0,49}, {9,0,194},
+    {7,0,264}, {8,0,97}, {8,0,33}, {9,0,162}, {8,0,1}, {8,0,129}, {8,0,65}, {9,0,226},
+    {7,0,260}, {8,0,89}, {8,0,25}, {9,0,146}, {7,0,276}, {8,0,121}, {8,0,57}, {9,0,210},
+    {7,0,268}, {8,0,105}, {8,0,41}, {9,0,178}, {8,0,9}, {8,0,137}, {8,0,73}, {9,0,242},
+    {7,0,258}, {8,0,85}, {8,0,21}, {8,0,285}, {7,0,274}, {8,0,117}, {8,0,53}, {9,0,202},
+    {7,0,266}, {8,0,101}, {8,0,37}, {9,0,170}, {8,0,5}, {8,0,133}, {8,0,69}, {9,0,234},
+    {7,0,262}, {8,0,93}, {8,0,29}, {9,0,154}, {7,0,278}, {8,0,125}, {8,0,61}, {9,0,218},
+    {7,0,270}, {8,0,109}, {8,0,45}, {9,0,186}, {8,0,13}, {8,0,141}, {8,0,77}, {9,0,250},
+    {7,0,257}, {8,0,83}, {8,0,19}, {8,0,283}, {7,0,273}, {8,0,115}, {8,0,51}, {9,0,198},
+    {7,0,265}, {8,0,99}, {8,0,35}, {9,0,166}, {8,0,3}, {8,0,131}, {8,0,67}, {9,0,230},
+    {7,0,261}, {8,0,91}, {8,0,27}, {9,0,150}, {7,0,277}, {8,0,123}, {8,0,59}, {9,0,214},
+    {7,0,269}, {8,0,107}, {8,0,43}, {9,0,182}, {8,0,11}, {8,0,139}, {8,0,75}, {9,0,246},
+    {7,0,259}, {8,0,87}, {8,0,23}, {8,0,287}, {7,0,275}, {8,0,119}, {8,0,55}, {9,0,206},
+    {7,0,267}, {8,0,103}, {8,0,39}, {9,0,174}, {8,0,7}, {8,0,135}, {8,0,71}, {9,0,238},
+    {7,0,263}, {8,0,95}, {8,0,31}, {9,0,158}, {7,0,279}, {8,0,127}, {8,0,63}, {9,0,222},
+    {7,0,271}, {8,0,111}, {8,0,47}, {9,0,190}, {8,0,15}, {8,0,143}, {8,0,79}, {9,0,254},
+    {7,0,256}, {8,0,80}, {8,0,16}, {8,0,280}, {7,0,272}, {8,0,112}, {8,0,48}, {9,0,193},
+    {7,0,264}, {8,0,96}, {8,0,32}, {9,0,161}, {8,0,0}, {8,0,128}, {8,0,64}, {9,0,225},
+    {7,0,260}, {8,0,88}, {8,0,24}, {9,0,145}, {7,0,276}, {8,0,120}, {8,0,56}, {9,0,209},
+    {7,0,268}, {8,0,104}, {8,0,40}, {9,0,177}, {8,0,8}, {8,0,136}, {8,0,72}, {9,0,241},
+    {7,0,258}, {8,0,84}, {8,0,20}, {8,0,284}, {7,0,274}, {8,0,116}, {8,0,52}, {9,0,201},
+    {7,0,266}, {8,0,100}, {8,0,36}, {9,0,169}, {8,0,4}, {8,0,132}, {8,0,68}, {9,0,233},
+    {7,0,262}, {8,0,92}, {8,0,28}, {9,0,153}, {7,0,278}, {8,0,124}, {8,0,60}, {9,0,217},
+    {7,0,270}, {8,0,108}, {8,0,44}, {9,0,185}, {8,0,12}, {8,0,140}, {8,0,76}, {9,0,249},
+    {7,0,257}, {8,0,82}, {8,0,18}, {8,0,282}, {7,0,273}, {8,0,114}, {8,0,50}, {9,0,197},
+    {7,0,265}, {8,0,98}, {8,0,34}, {9,0,165}, {8,0,2}, {8,0,130}, {8,0,66}, {9,0,229},
+    {7,0,261}, {8,0,90}, {8,0,26}, {9,0,149}, {7,0,277}, {8,0,122}, {8,0,58}, {9,0,213},
+    {7,0,269}, {8,0,106}, {8,0,42}, {9,0,181}, {8,0,10}, {8,0,138}, {8,0,74}, {9,0,245},
+    {7,0,259}, {8,0,86}, {8,0,22}, {8,0,286}, {7,0,275}, {8,0,118}, {8,0,54}, {9,0,205},
+    {7,0,267}, {8,0,102}, {8,0,38}, {9,0,173}, {8,0,6}, {8,0,134}, {8,0,70}, {9,0,237},
+    {7,0,263}, {8,0,94}, {8,0,30}, {9,0,157}, {7,0,279}, {8,0,126}, {8,0,62}, {9,0,221},
+    {7,0,271}, {8,0,110}, {8,0,46}, {9,0,189}, {8,0,14}, {8,0,142}, {8,0,78}, {9,0,253},
+    {7,0,256}, {8,0,81}, {8,0,17}, {8,0,281}, {7,0,272}, {8,0,113}, {8,0,49}, {9,0,195},
+    {7,0,264}, {8,0,97}, {8,0,33}, {9,0,163}, {8,0,1}, {8,0,129}, {8,0,65}, {9,0,227},
+    {7,0,260}, {8,0,89}, {8,0,25}, {9,0,147}, {7,0,276}, {8,0,121}, {8,0,57}, {9,0,211},
+    {7,0,268}, {8,0,105}, {8,0,41}, {9,0,179}, {8,0,9}, {8,0,137}, {8,0,73}, {9,0,243},
+    {7,0,258}, {8,0,85}, {8,0,21}, {8,0,285}, {7,0,274}, {8,0,117}, {8,0,53}, {9,0,203},
+    {7,0,266}, {8,0,101}, {8,0,37}, {9,0,171}, {8,0,5}, {8,0,133}, {8,0,69}, {9,0,235},
+    {7,0,262}, {8,0,93}, {8,0,29}, {9,0,155}, {7,0,278}, {8,0,125}, {8,0,61}, {9,0,219},
+    {7,0,270}, {8,0,109}, {8,0,45}, {9,0,187}, {8,0,13}, {8,0,141}, {8,0,77}, {9,0,251},
+    {7,0,257}, {8,0,83}, {8,0,19}, {8,0,283}, {7,0,273}, {8,0,115}, {8,0,51}, {9,0,199},
+    {7,0,265}, {8,0,99}, {8,0,35}, {9,0,167}, {8,0,3}, {8,0,131}, {8,0,67}, {9,0,231},
+    {7,0,261}, {8,0,91}, {8,0,27}, {9,0,151}, {7,0,277}, {8,0,123}, {8,0,59}, {9,0,215},
+    {7,0,269}, {8,0,107}, {8,0,43}, {9,0,183}, {8,0,11}, {8,0,139}, {8,0,75}, {9,0,247},
+    {7,0,259}, {8,0,87}, {8,0,23}, {8,0,287}, {7,0,275}, {8,0,119}, {8,0,55}, {9,0,207},
+    {7,0,267}, {8,0,103}, {8,0,39}, {9,0,175}, {8,0,7}, {8,0,135}, {8,0,71}, {9,0,239},
+    {7,0,263}, {8,0,95}, {8,0,31}, {9,0,159}, {7,0,279}, {8,0,127}, {8,0,63}, {9,0,223},
+    {7,0,271}, {8,0,111}, {8,0,47}, {9,0,191}, {8,0,15}, {8,0,143}, {8,0,79}, {9,0,255}
+};
+static const struct hentry fixed_disttab[1 << DIST_ROOT] = {
+    {5,0,0}, {5,0,16}, {5,0,8}, {5,0,24}, {5,0,4}, {5,0,20}, {5,0,12}, {5,0,28},
+    {5,0,2}, {5,0,18}, {5,0,10}, {5,0,26}, {5,0,6}, {5,0,22}, {5,0,14}, {5,0,30},
+    {5,0,1}, {5,0,17}, {5,0,9}, {5,0,25}, {5,0,5}, {5,0,21}, {5,0,13}, {5,0,29},
+    {5,0,3}, {5,0,19}, {5,0,11}, {5,0,27}, {5,0,7}, {5,0,23}, {5,0,15}, {5,0,31},
+    {5,0,0}, {5,0,16}, {5,0,8}, {5,0,24}, {5,0,4}, {5,0,20}, {5,0,12}, {5,0,28},
+    {5,0,2}, {5,0,18}, {5,0,10}, {5,0,26}, {5,0,6}, {5,0,22}, {5,0,14}, {5,0,30},
+    {5,0,1}, {5,0,17}, {5,0,9}, {5,0,25}, {5,0,5}, {5,0,21}, {5,0,13}, {5,0,29},
+    {5,0,3}, {5,0,19}, {5,0,11}, {5,0,27}, {5,0,7}, {5,0,23}, {5,0,15}, {5,0,31}
+};
+
+/*
+ * Decompression state.  Everything one stream needs lives in its
+ * context, so each caller can own one and reuse it for stream after
+ * stream.
+ */
+struct gz_inflate {
+    /* Bit buffer for reading bit-by-bit */
+    unsigned long bitbuf;
+    int bitcount;
+    
+    /* Input/output callbacks; with no write callback output is dropped */
+    gz_read_func read;
+    void *read_arg;
+    gz_write_func write;
+    void *write_arg;
+    
+    /* Input buffer feeding the bit buffer */
+    unsigned char *inbuf;
+    unsigned char *inptr;
+    unsigned char *inend;
+    long bytes_read;
+    
+    /* Output buffer for LZ77 decompression; window[0..wpos) is history */
+    unsigned char *window;
+    unsigned int wpos;
+    unsigned int wstart;        /* Window before this was output earlier */
+    long bytes_output;
+    
+    /* CRC32 value */
+    unsigned long crc;
+    
+    /* Output offset where the current member began */
+    long member_start;
+    
+    /* Pipelined mode: the writer process checksums the output, so
+     * check the combined CRC of the members decoded so far instead */
+    int pipelined;
+    unsigned long expected_total;
+    
+    /* Random-access index being built, and the context and buffer that
+     * compress its windows */
+    FILE *index_file;
+    struct gz_deflate *index_deflate;
+    unsigned char *index_buf;
+    long next_point;
+    int npoints;
+    
+    /* Output range wanted when extracting, or -1 for all of it */
+    long extract_start;
+    long extract_end;
+    
+    /* Stop decoding at a full flush at or after this input offset */
+    long stop_offset;
+    
+    /* Print header and block details */
+    int verbose;
+    
+    /* Called with the input offset each time output is written, if set */
+    void (*progress)(long done);
+    
+    /* What went wrong, and what was odd but allowed */
+    char *error;
+    char errbuf[80];
+    int size_mismatch;          /* A trailer gave the wrong length */
+    int garbage;                /* The last member is followed by garbage */
+    
+    /* Tables for the current dynamic block */
+    struct hentry dyn_lentab[LEN_ENOUGH];
+    struct hentry dyn_disttab[DIST_ENOUGH];
+    struct hentry dyn_codetab[CODE_ENOUGH];
 };
 
 /*
- * Initialize CRC32 table
+ * Record what went wrong, keeping the first error, and return -1
  */
-static void make_crc_table(void)
+static int fail(struct gz_inflate *s, char *why)
 {
-    unsigned long c;
-    int n, k;
+    if (s->error == NULL)
+        s->error = why;
+    return -1;
+}
+
+/*
+ * Refill the input buffer, returning the number of bytes read
+ */
+static int fill_inbuf(struct gz_inflate *s)
+{
+    int n = 0;
     
-    for (n = 0; n < 256; n++) {
-        c = (unsigned long)n;
-        for (k = 0; k < 8; k++) {
-            if (c & 1)
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
-        }
-        crc_table[n] = c;
+    if (s->read != NULL && (n = s->read(s->read_arg, s->inbuf, INBUFSIZ)) < 0) {
+        fail(s, "Cannot read input");
+        n = 0;
     }
+    s->inptr = s->inbuf;
+    s->inend = s->inbuf + n;
+    s->bytes_read += n;
+    return n;
 }
 
 /*
- * Update CRC32 with new byte
+ * Top up the bit buffer with as many whole bytes as fit, or as remain.
+ * The fast path may leave bits of the next unconsumed byte above
+ * bitcount; the next refill ORs that same byte into the same place, so
+ * only bits below bitcount are meaningful.
  */
-static void update_crc(unsigned char c)
+static void refill(struct gz_inflate *s)
 {
-    crc = crc_table[(crc ^ c) & 0xff] ^ (crc >> 8);
+#ifdef FAST_REFILL
+    unsigned long w;
+    
+    if (s->inend - s->inptr >= 8) {
+        memcpy(&w, s->inptr, 8);
+        s->bitbuf |= w << s->bitcount;
+        s->inptr += (63 - s->bitcount) >> 3;
+        s->bitcount |= 56;
+        return;
+    }
+#endif
+    while (s->bitcount <= BITBUF_BITS - 8) {
+        if (s->inptr == s->inend && fill_inbuf(s) == 0)
+            return;
+        s->bitbuf |= (unsigned long)*s->inptr++ << s->bitcount;
+        s->bitcount += 8;
+    }
 }
 
 /*
  * Get bits from input stream
  */
-static int getbits(int n)
+static int getbits(struct gz_inflate *s, int n)
 {
     int val;
     
-    /* Load bytes into bit buffer until we have enough */
-    while (bitcount < n) {
-        int c = getc(infile);
-        if (c == EOF)
+    if (s->bitcount < n) {
+        refill(s);
+        if (s->bitcount < n)
             return -1;
-        bitbuf |= ((unsigned long)c << bitcount);
-        bitcount += 8;
     }
     
     /* Extract n bits */
-    val = bitbuf & ((1 << n) - 1);
-    bitbuf >>= n;
-    bitcount -= n;
+    val = PEEKBITS(n);
+    DROPBITS(n);
     
     return val;
 }
 
 /*
- * Build Huffman decoding tables
+ * Discard bits up to the next byte boundary.  Whole bytes read ahead
+ * by the Huffman decoder stay in the bit buffer for getbits(8).
+ */
+static void alignbits(struct gz_inflate *s)
+{
+    s->bitbuf >>= s->bitcount & 7;
+    s->bitcount &= ~7;
+}
+
+/*
+ * Offset in the input file of the next whole byte not yet consumed
+ */
+static long input_offset(struct gz_inflate *s)
+{
+    return s->bytes_read - (s->inend - s->inptr) - s->bitcount / 8;
+}
+
+/*
+ * Reverse the low len bits of code
  */
-static int build_huffman(struct huffman *h, int *length, int n)
+static unsigned int reverse_bits(unsigned int code, int len)
 {
-    int len, code, first, count, index;
-    short offs[MAX_BITS + 1];
-    int i;
+    unsigned int rev = 0;
+    
+    while (len--) {
+        rev = (rev << 1) | (code & 1);
+        code >>= 1;
+    }
+    return rev;
+}
+
+/*
+ * Build Huffman decoding tables from code lengths into table, which
+ * holds h->size entries.  An empty code builds a table of invalid
+ * entries, which only fails if it is used.
+ */
+static int build_huffman(struct huffman *h, struct hentry *table, int *length, int n)
+{
+    short count[MAX_BITS + 1];
+    unsigned int code[MAX_BITS + 1];
+    unsigned int next[MAX_BITS + 1];
+    unsigned char subbits[1 << LEN_ROOT];
+    struct hentry *e;
+    unsigned int rev, mask, off, fill, step;
+    long left;
+    int len, sym, i, root, sub;
+    
+    h->table = table;
+    root = h->root;
+    mask = (1U << root) - 1;
     
     /* Count number of codes for each length */
     for (len = 0; len <= MAX_BITS; len++)
-        h->count[len] = 0;
-    
-    for (i = 0; i < n; i++)
-        h->count[length[i]]++;
+        count[len] = 0;
+    for (sym = 0; sym < n; sym++)
+        count[length[sym]]++;
     
     /* Check for over-subscribed or incomplete set */
-    if (h->count[0] == n)
-        return 0;   /* Complete, but empty code */
+    left = 1;
+    for (len = 1; len <= MAX_BITS; len++) {
+        left <<= 1;
+        left -= count[len];
+        if (left < 0)
+            return -1;
+    }
+    
+    /* Only an empty code or a single one-bit code may be incomplete */
+    if (left > 0 && count[0] != n && (count[0] != n - 1 || count[1] != 1))
+        return -1;
     
-    /* Generate offsets into symbol table for each length */
-    offs[1] = 0;
+    /* First canonical code of each length */
+    code[1] = 0;
     for (len = 1; len < MAX_BITS; len++)
-        offs[len + 1] = offs[len] + h->count[len];
+        code[len + 1] = (code[len] + count[len]) << 1;
+    
+    /* Find the longest code behind each primary entry */
+    for (i = 0; i <= (int)mask; i++)
+        subbits[i] = 0;
+    for (len = 1; len <= MAX_BITS; len++)
+        next[len] = code[len];
+    for (sym = 0; sym < n; sym++) {
+        len = length[sym];
+        if (len <= root)
+            continue;
+        rev = reverse_bits(next[len]++, len) & mask;
+        if (len - root > subbits[rev])
+            subbits[rev] = len - root;
+    }
+    
+    /* Clear primary table and lay out sub-tables after it */
+    for (i = 0; i <= (int)mask; i++) {
+        table[i].bits = 0;
+        table[i].sub = 0;
+        table[i].val = 0;
+    }
+    off = mask + 1;
+    for (i = 0; i <= (int)mask; i++) {
+        if (subbits[i] == 0)
+            continue;
+        fill = 1U << subbits[i];
+        if (off + fill > (unsigned int)h->size)
+            return -1;
+        table[i].bits = root;
+        table[i].sub = subbits[i];
+        table[i].val = off;
+        for (e = table + off; fill--; e++) {
+            e->bits = 0;
+            e->sub = 0;
+            e->val = 0;
+        }
+        off += 1U << subbits[i];
+    }
     
-    /* Put symbols in table sorted by length */
-    for (i = 0; i < n; i++)
-        if (length[i] != 0)
-            h->symbol[offs[length[i]]++] = i;
+    /* Replicate each code over every entry it prefixes */
+    for (sym = 0; sym < n; sym++) {
+        len = length[sym];
+        if (len == 0)
+            continue;
+        rev = reverse_bits(code[len]++, len);
+        if (len <= root) {
+            e = table;
+            fill = mask + 1;
+            step = 1U << len;
+        }
+        else {
+            e = table + table[rev & mask].val;
+            sub = table[rev & mask].sub;
+            fill = 1U << sub;
+            rev >>= root;
+            len -= root;
+            step = 1U << len;
+        }
+        for (; rev < fill; rev += step) {
+            e[rev].bits = len;
+            e[rev].val = sym;
+        }
+    }
     
-    return 1;
+    return 0;
 }
 
 /*
  * Decode a symbol from the input using Huffman table
  */
-static int decode_symbol(struct huffman *h)
+static int decode_symbol(struct gz_inflate *s, struct huffman *h)
 {
-    int len, code, first, count, index;
+    const struct hentry *e;
     
-    code = first = index = 0;
+    if (s->bitcount < MAX_BITS)
+        refill(s);
     
-    for (len = 1; len <= MAX_BITS; len++) {
-        int bit = getbits(1);
-        if (bit < 0)
+    e = &h->table[PEEKBITS(h->root)];
+    if (e->sub) {
+        /* Long code - continue in the sub-table */
+        if (s->bitcount < e->bits)
             return -1;
-        
-        code |= bit;
-        count = h->count[len];
-        
-        if (code < first + count)
-            return h->symbol[index + (code - first)];
-        
-        index += count;
-        first += count;
-        first <<= 1;
-        code <<= 1;
+        DROPBITS(e->bits);
+        e = &h->table[e->val + PEEKBITS(e->sub)];
+    }
+    
+    if (e->bits == 0 || e->bits > s->bitcount)
+        return -1;  /* Invalid code or ran out of input */
+    
+    DROPBITS(e->bits);
+    return e->val;
+}
+
+/*
+ * Offset in the output of the next byte to be decoded
+ */
+static long output_offset(struct gz_inflate *s)
+{
+    return s->bytes_output + (long)(s->wpos - s->wstart);
+}
+
+/*
+ * Hand output to the write callback, if there is one
+ */
+static int write_out(struct gz_inflate *s, unsigned char *buf, unsigned int n)
+{
+    if (s->write != NULL && n > 0 && s->write(s->write_arg, buf, n) != 0)
+        return fail(s, "Cannot write output");
+    return 0;
+}
+
+/*
+ * Write the part of the new output that falls inside the range being
+ * extracted
+ */
+static int write_range(struct gz_inflate *s)
+{
+    long from = 0, to = s->wpos - s->wstart;
+    
+    if (s->bytes_output < s->extract_start)
+        from = s->extract_start - s->bytes_output;
+    if (s->bytes_output + to > s->extract_end)
+        to = s->extract_end - s->bytes_output;
+    if (to > from)
+        return write_out(s, s->window + s->wstart + from, (unsigned)(to - from));
+    return 0;
+}
+
+/*
+ * Write out the output from wstart, updating the CRC and progress.
+ * Once another match might not fit, the last WSIZE bytes move to the
+ * front of the buffer as history.  Returns -1 if writing fails.
+ */
+static int flush_window(struct gz_inflate *s)
+{
+    int status;
+    
+    if (s->wpos == s->wstart)
+        return 0;
+    
+    if (s->extract_end < 0)
+        status = write_out(s, s->window + s->wstart, s->wpos - s->wstart);
+    else
+        status = write_range(s);
+    if (!s->pipelined)
+        s->crc = update_crc(s->crc, s->window + s->wstart, s->wpos - s->wstart);
+    s->bytes_output += s->wpos - s->wstart;
+    s->wstart = s->wpos;
+    
+    if (s->wpos > OUTSIZE - MAX_MATCH) {
+        memmove(s->window, s->window + s->wpos - WSIZE, WSIZE);
+        s->wpos = s->wstart = WSIZE;
     }
     
-    return -1;  /* Ran out of codes */
+    /* Show progress each time output is written */
+    if (s->progress != NULL)
+        s->progress(s->bytes_read - (long)(s->inend - s->inptr));
+    return status;
 }
 
 /*
- * Output a byte to the window and output file
+ * Copy a match of len bytes starting dist bytes back.  The caller makes
+ * sure there is room for it.
  */
-static void output_byte(unsigned char c, FILE *outfile)
+static void copy_match(struct gz_inflate *s, unsigned int len, unsigned int dist)
 {
-    window[wpos++] = c;
-    if (wpos >= WSIZE)
-        wpos = 0;
-    putc(c, outfile);
-    update_crc(c);
-    bytes_output++;
+    unsigned char *dst, *src;
+    unsigned int n;
     
-    /* Show progress every 1000 bytes */
-    if (++progress_counter % 1000 == 0 && compressed_size > 0) {
-        long current_pos = ftell(infile);
-        if (current_pos > 0) {
-            int percent = (int)((current_pos * 100L) / compressed_size);
-            fprintf(stderr, "\rDecompressing: %d%% (%ld/%ld bytes)", 
-                    percent, current_pos, compressed_size);
+    dst = s->window + s->wpos;
+    src = dst - dist;
+    s->wpos += len;
+    
+    if (dist >= len) {
+        /* Source ends before us */
+        memcpy(dst, src, len);
+    }
+    else if (dist == 1) {
+        /* Run of a single byte */
+        memset(dst, *src, len);
+    }
+    else {
+        /* Overlapping copy repeats with period dist; the copied
+         * pattern doubles in length with each pass */
+        while (len > 0) {
+            n = dst - src;
+            if (n > len)
+                n = len;
+            memcpy(dst, src, n);
+            dst += n;
+            len -= n;
         }
     }
 }
@@ -195,7 +635,7 @@ static void output_byte(unsigned char c, FILE *outfile)
 /*
  * Decode literal/length and distance codes
  */
-static int decode_codes(struct huffman *lencode, struct huffman *distcode, FILE *outfile)
+static int decode_codes(struct gz_inflate *s, struct huffman *lencode, struct huffman *distcode)
 {
     int symbol, len, dist;
     
@@ -222,12 +662,16 @@ static int decode_codes(struct huffman *lencode, struct huffman *distcode, FILE
     
     /* Decode literals and length/distance pairs */
     while (1) {
-        symbol = decode_symbol(lencode);
+        /* Make room for the longest match */
+        if (s->wpos > OUTSIZE - MAX_MATCH && flush_window(s) != 0)
+            return -1;
+        
+        symbol = decode_symbol(s, lencode);
         if (symbol < 0) return -1;
         
         if (symbol < 256) {
             /* Literal byte */
-            output_byte((unsigned char)symbol, outfile);
+            s->window[s->wpos++] = (unsigned char)symbol;
         }
         else if (symbol == 256) {
             /* End of block */
@@ -238,69 +682,65 @@ static int decode_codes(struct huffman *lencode, struct huffman *distcode, FILE
             symbol -= 257;
             if (symbol >= 29) return -1;
             
-            len = lens[symbol] + getbits(lext[symbol]);
+            len = getbits(s, lext[symbol]);
+            if (len < 0) return -1;
+            len += lens[symbol];
             
-            symbol = decode_symbol(distcode);
-            if (symbol < 0) return -1;
+            symbol = decode_symbol(s, distcode);
+            if (symbol < 0 || symbol >= 30) return -1;
             
-            dist = dists[symbol] + getbits(dext[symbol]);
+            dist = getbits(s, dext[symbol]);
+            if (dist < 0) return -1;
+            dist += dists[symbol];
             
-            /* Copy from window */
-            while (len--) {
-                unsigned int pos = (wpos >= (unsigned int)dist) ? (wpos - dist) : (WSIZE - dist + wpos);
-                output_byte(window[pos], outfile);
-            }
+            /* Distance cannot reach back before the start of output */
+            if ((unsigned int)dist > s->wpos)
+                return fail(s, "Distance too far back");
+            
+            /* Copy from history */
+            copy_match(s, len, dist);
         }
     }
     
     return 0;
 }
 
+/*
+ * Set up the fixed Huffman codes
+ */
+static void fixed_codes(struct huffman *lencode, struct huffman *distcode)
+{
+    lencode->table = fixed_lentab;
+    lencode->root = LEN_ROOT;
+    lencode->size = 1 << LEN_ROOT;
+    
+    distcode->table = fixed_disttab;
+    distcode->root = DIST_ROOT;
+    distcode->size = 1 << DIST_ROOT;
+}
+
 /*
  * Decompress a block with fixed Huffman codes
  */
-static int inflate_fixed(FILE *outfile)
+static int inflate_fixed(struct gz_inflate *s)
 {
     struct huffman lencode, distcode;
-    short lencnt[MAX_BITS + 1], lensym[288];
-    short distcnt[MAX_BITS + 1], distsym[32];
-    int lengths[288];
-    int i, symbol, len, dist;
-    
-    /* Build fixed literal/length code */
-    lencode.count = lencnt;
-    lencode.symbol = lensym;
     
-    for (i = 0; i < 144; i++) lengths[i] = 8;
-    for (i = 144; i < 256; i++) lengths[i] = 9;
-    for (i = 256; i < 280; i++) lengths[i] = 7;
-    for (i = 280; i < 288; i++) lengths[i] = 8;
-    
-    build_huffman(&lencode, lengths, 288);
-    
-    /* Build fixed distance code */
-    distcode.count = distcnt;
-    distcode.symbol = distsym;
-    
-    for (i = 0; i < 32; i++) lengths[i] = 5;
-    build_huffman(&distcode, lengths, 32);
+    fixed_codes(&lencode, &distcode);
     
     /* Decode using the fixed codes */
-    return decode_codes(&lencode, &distcode, outfile);
+    return decode_codes(s, &lencode, &distcode);
 }
 
 /*
  * Decompress a block with dynamic Huffman codes
  */
-static int inflate_dynamic(FILE *outfile)
+static int inflate_dynamic(struct gz_inflate *s)
 {
     struct huffman lencode, distcode, codecode;
-    short lencnt[MAX_BITS + 1], lensym[320];
-    short distcnt[MAX_BITS + 1], distsym[32];
-    short codecnt[MAX_BITS + 1], codesym[19];
     int lengths[320];
     int nlen, ndist, ncode;
-    int i, symbol;
+    int i, symbol, extra;
     
     /* Order of code length code lengths */
     static short order[19] = {
@@ -308,33 +748,36 @@ static int inflate_dynamic(FILE *outfile)
     };
     
     /* Get number of length and distance codes */
-    nlen = getbits(5) + 257;
-    ndist = getbits(5) + 1;
-    ncode = getbits(4) + 4;
-    
-    if (nlen > 286 || ndist > 32) {
-        fprintf(stderr, "Error: Invalid dynamic block header\n");
-        return -1;
-    }
+    nlen = getbits(s, 5);
+    ndist = getbits(s, 5);
+    ncode = getbits(s, 4);
+    if (nlen < 0 || ndist < 0 || ncode < 0)
+        return fail(s, "Premature EOF in dynamic block header");
+    nlen += 257;
+    ndist += 1;
+    ncode += 4;
+    
+    if (nlen > 286 || ndist > 30)
+        return fail(s, "Invalid dynamic block header");
     
     /* Read code length code lengths */
-    for (i = 0; i < ncode; i++)
-        lengths[order[i]] = getbits(3);
+    for (i = 0; i < ncode; i++) {
+        if ((lengths[order[i]] = getbits(s, 3)) < 0)
+            return fail(s, "Premature EOF in dynamic block header");
+    }
     for (; i < 19; i++)
         lengths[order[i]] = 0;
     
     /* Build code length code table */
-    codecode.count = codecnt;
-    codecode.symbol = codesym;
-    if (build_huffman(&codecode, lengths, 19) == 0) {
-        fprintf(stderr, "Error: Invalid code length code\n");
-        return -1;
-    }
+    codecode.root = CODE_ROOT;
+    codecode.size = CODE_ENOUGH;
+    if (build_huffman(&codecode, s->dyn_codetab, lengths, 19) != 0)
+        return fail(s, "Invalid code length code");
     
     /* Read length and distance code lengths */
     i = 0;
     while (i < nlen + ndist) {
-        symbol = decode_symbol(&codecode);
+        symbol = decode_symbol(s, &codecode);
         if (symbol < 0) return -1;
         
         if (symbol < 16) {
@@ -347,185 +790,276 @@ static int inflate_dynamic(FILE *outfile)
             int val = 0;
             
             if (symbol == 16) {
-                if (i == 0) {
-                    fprintf(stderr, "Error: Invalid repeat code\n");
-                    return -1;
-                }
+                if (i == 0)
+                    return fail(s, "Invalid repeat code");
                 val = lengths[i - 1];
-                len = 3 + getbits(2);
+                len = 3 + (extra = getbits(s, 2));
             }
             else if (symbol == 17) {
-                len = 3 + getbits(3);
+                len = 3 + (extra = getbits(s, 3));
             }
             else {
-                len = 11 + getbits(7);
+                len = 11 + (extra = getbits(s, 7));
             }
+            if (extra < 0)
+                return fail(s, "Premature EOF in code lengths");
             
-            if (i + len > nlen + ndist) {
-                if (inflate_dynamic(outfile) != 0)
-                    return -1;
-                break;
-            }
+            if (i + len > nlen + ndist)
+                return fail(s, "Repeat code overruns code lengths");
             
             while (len--)
                 lengths[i++] = val;
         }
     }
     
+    /* The end-of-block code must be present */
+    if (lengths[256] == 0)
+        return fail(s, "Missing end-of-block code");
+    
     /* Build literal/length code table */
-    lencode.count = lencnt;
-    lencode.symbol = lensym;
-    if (build_huffman(&lencode, lengths, nlen) == 0) {
-        fprintf(stderr, "Error: Invalid literal/length code\n");
-        return -1;
-    }
+    lencode.root = LEN_ROOT;
+    lencode.size = LEN_ENOUGH;
+    if (build_huffman(&lencode, s->dyn_lentab, lengths, nlen) != 0)
+        return fail(s, "Invalid literal/length code");
     
     /* Build distance code table */
-    distcode.count = distcnt;
-    distcode.symbol = distsym;
-    if (build_huffman(&distcode, lengths + nlen, ndist) == 0) {
-        fprintf(stderr, "Error: Invalid distance code\n");
-        return -1;
-    }
+    distcode.root = DIST_ROOT;
+    distcode.size = DIST_ENOUGH;
+    if (build_huffman(&distcode, s->dyn_disttab, lengths + nlen, ndist) != 0)
+        return fail(s, "Invalid distance code");
     
     /* Decode using the dynamic codes */
-    return decode_codes(&lencode, &distcode, outfile);
+    return decode_codes(s, &lencode, &distcode);
 }
 
 /*
  * Decompress uncompressed block
  */
-static int inflate_uncompressed(FILE *outfile)
+static int inflate_uncompressed(struct gz_inflate *s)
 {
-    unsigned int len, nlen;
-    int i;
+    unsigned int len, nlen, n;
+    int b0, b1, b2, b3;
     
     /* Discard bits to byte boundary */
-    bitbuf = 0;
-    bitcount = 0;
-    
-    /* Get length */
-    len = getc(infile);
-    len |= getc(infile) << 8;
-    
-    /* Get one's complement of length */
-    nlen = getc(infile);
-    nlen |= getc(infile) << 8;
+    alignbits(s);
+    
+    /* Get length and its one's complement */
+    b0 = getbits(s, 8);
+    b1 = getbits(s, 8);
+    b2 = getbits(s, 8);
+    b3 = getbits(s, 8);
+    if (b0 < 0 || b1 < 0 || b2 < 0 || b3 < 0)
+        return fail(s, "Premature EOF in uncompressed block");
+    len = (unsigned int)b0 | ((unsigned int)b1 << 8);
+    nlen = (unsigned int)b2 | ((unsigned int)b3 << 8);
     
     /* Check validity */
-    if (len != (~nlen & 0xffff)) {
-        fprintf(stderr, "Error: Invalid uncompressed block length\n");
-        return -1;
+    if (len != (~nlen & 0xffff))
+        return fail(s, "Invalid uncompressed block length");
+    
+    /* Copy bytes still held in the bit buffer */
+    while (len > 0 && s->bitcount >= 8) {
+        s->window[s->wpos++] = (unsigned char)PEEKBITS(8);
+        DROPBITS(8);
+        len--;
+        if (s->wpos == OUTSIZE && flush_window(s) != 0)
+            return -1;
     }
-    
-    /* Copy bytes */
-    for (i = 0; i < len; i++) {
-        int c = getc(infile);
-        if (c == EOF) {
-            fprintf(stderr, "Error: Premature EOF in uncompressed block\n");
+    if (s->bitcount == 0)
+        s->bitbuf = 0;     /* Drop read-ahead before bypassing the bit buffer */
+    
+    /* Copy the rest straight from the input buffer */
+    while (len > 0) {
+        if (s->inptr == s->inend && fill_inbuf(s) == 0)
+            return fail(s, "Premature EOF in uncompressed block");
+        n = s->inend - s->inptr;
+        if (n > len)
+            n = len;
+        if (n > OUTSIZE - s->wpos)
+            n = OUTSIZE - s->wpos;
+        memcpy(s->window + s->wpos, s->inptr, n);
+        s->inptr += n;
+        s->wpos += n;
+        len -= n;
+        if (s->wpos == OUTSIZE && flush_window(s) != 0)
             return -1;
-        }
-        output_byte((unsigned char)c, outfile);
     }
     
     return 0;
 }
 
 /*
- * Decompress DEFLATE stream
+ * Write a number to the index as n little-endian bytes
+ */
+static void put_number(FILE *fp, unsigned long v, int n)
+{
+    while (n-- > 0) {
+        putc((int)(v & 0xff), fp);
+        v >>= 8;
+    }
+}
+
+/*
+ * Add an access point at the current block boundary: the output offset,
+ * the offset of the next whole input byte, the number of bits of the
+ * byte before it still to be read, and the last 32KB of output, oldest
+ * first, as a gzip member after its length
+ */
+static void record_point(struct gz_inflate *s)
+{
+    long in = input_offset(s);
+    long len;
+    
+    len = gz_deflate_buffer(s->index_deflate, s->window + s->wpos - WSIZE,
+                            (long)WSIZE, s->index_buf, INDEX_WINDOW);
+    if (len < 0)
+        return;
+    put_number(s->index_file, (unsigned long)output_offset(s), 8);
+    put_number(s->index_file, (unsigned long)in, 8);
+    putc(s->bitcount % 8, s->index_file);
+    put_number(s->index_file, (unsigned long)len, 4);
+    fwrite(s->index_buf, 1, (size_t)len, s->index_file);
+    
+    s->npoints++;
+    s->next_point = output_offset(s) + INDEX_SPAN;
+}
+
+/*
+ * Decompress DEFLATE stream.  Returns 1 if it stopped at a full flush
+ * at or after stop_offset rather than at the final block.
  */
-static int inflate(FILE *outfile)
+static int inflate(struct gz_inflate *s)
 {
     int bfinal, btype;
+    long before;
     
     do {
+        before = output_offset(s);
+        
+        /* Blocks start at a bit offset an index can resume from */
+        if (s->index_file != NULL && output_offset(s) >= s->next_point &&
+            s->wpos >= WSIZE)
+            record_point(s);
+        
         /* Read block header */
-        bfinal = getbits(1);
-        btype = getbits(2);
+        bfinal = getbits(s, 1);
+        btype = getbits(s, 2);
         
-        if (bfinal < 0 || btype < 0) {
-            fprintf(stderr, "Error: Cannot read block header\n");
-            return -1;
-        }
+        if (bfinal < 0 || btype < 0)
+            return fail(s, "Cannot read block header");
         
-        printf("Block: %s, type=%d\n", bfinal ? "final" : "non-final", btype);
+        if (s->verbose)
+            printf("Block: %s, type=%d\n", bfinal ? "final" : "non-final", btype);
         
         switch (btype) {
             case 0:
                 /* Uncompressed */
-                if (inflate_uncompressed(outfile) != 0)
+                if (inflate_uncompressed(s) != 0)
                     return -1;
                 break;
             
             case 1:
                 /* Fixed Huffman codes */
-                if (inflate_fixed(outfile) != 0)
+                if (inflate_fixed(s) != 0)
                     return -1;
                 break;
             
             case 2:
                 /* Dynamic Huffman codes */
-                if (inflate_dynamic(outfile) != 0)
+                if (inflate_dynamic(s) != 0)
                     return -1;
                 break;
             
             case 3:
-                fprintf(stderr, "Error: Invalid block type\n");
-                return -1;
+                return fail(s, "Invalid block type");
         }
-    } while (!bfinal);
+        
+        /* A flush ends with an empty stored block */
+        if (s->stop_offset >= 0 && !bfinal && btype == 0 &&
+            output_offset(s) == before && input_offset(s) >= s->stop_offset)
+            return (flush_window(s) != 0) ? -1 : 1;
+    } while (!bfinal &&
+             !(s->extract_end >= 0 && output_offset(s) >= s->extract_end));
+    
+    /* Write out what is left in the window */
+    return flush_window(s);
+}
+
+/*
+ * Compare the finished CRC with the one expected
+ */
+static int check_crc(struct gz_inflate *s, unsigned long expected_crc)
+{
+    unsigned long actual_crc = s->crc ^ 0xffffffffL;
     
+    if (expected_crc != actual_crc) {
+        sprintf(s->errbuf, "CRC mismatch (expected 0x%08lx, got 0x%08lx)",
+                expected_crc, actual_crc);
+        return fail(s, s->errbuf);
+    }
     return 0;
 }
 
 /*
- * Read and verify gzip trailer
+ * Read a member's 8-byte gzip trailer, starting with any bytes already
+ * buffered
  */
-static int read_trailer(FILE *fp)
+static int get_trailer(struct gz_inflate *s, unsigned long *expected_crc, unsigned long *expected_size)
 {
     unsigned char buf[8];
-    unsigned long expected_crc, expected_size;
-    unsigned long actual_crc;
-    
-    /* Read 8-byte trailer */
-    if (fread(buf, 1, 8, fp) != 8) {
-        fprintf(stderr, "Error: Cannot read gzip trailer\n");
-        return -1;
+    int i, c;
+    
+    alignbits(s);
+    for (i = 0; i < 8; i++) {
+        c = getbits(s, 8);
+        if (c < 0)
+            return fail(s, "Cannot read gzip trailer");
+        buf[i] = c;
     }
     
     /* Extract CRC32 (little-endian) */
-    expected_crc = (unsigned long)buf[0] |
-                   ((unsigned long)buf[1] << 8) |
-                   ((unsigned long)buf[2] << 16) |
-                   ((unsigned long)buf[3] << 24);
+    *expected_crc = (unsigned long)buf[0] |
+                    ((unsigned long)buf[1] << 8) |
+                    ((unsigned long)buf[2] << 16) |
+                    ((unsigned long)buf[3] << 24);
     
     /* Extract uncompressed size (little-endian) */
-    expected_size = (unsigned long)buf[4] |
-                    ((unsigned long)buf[5] << 8) |
-                    ((unsigned long)buf[6] << 16) |
-                    ((unsigned long)buf[7] << 24);
-    
-    /* Finalize CRC */
-    actual_crc = crc ^ 0xffffffffL;
+    *expected_size = (unsigned long)buf[4] |
+                     ((unsigned long)buf[5] << 8) |
+                     ((unsigned long)buf[6] << 16) |
+                     ((unsigned long)buf[7] << 24);
+    return 0;
+}
+
+/*
+ * Read and verify a member's gzip trailer
+ */
+static int read_trailer(struct gz_inflate *s)
+{
+    unsigned long expected_crc, expected_size;
+    long member_size = s->bytes_output - s->member_start;
     
-    if (expected_crc != actual_crc) {
-        fprintf(stderr, "\nError: CRC mismatch!\n");
-        fprintf(stderr, "  Expected: 0x%08lx\n", expected_crc);
-        fprintf(stderr, "  Actual:   0x%08lx\n", actual_crc);
+    if (get_trailer(s, &expected_crc, &expected_size) != 0)
         return -1;
-    }
     
-    if ((expected_size & 0xffffffffL) != (bytes_output & 0xffffffffL)) {
-        fprintf(stderr, "Warning: Size mismatch (modulo 2^32)\n");
+    if ((expected_size & 0xffffffffL) != (member_size & 0xffffffffL))
+        s->size_mismatch = 1;
+    
+    /* The writer process checksums all members together, so check
+     * against the combination of their CRCs once it is done */
+    if (s->pipelined) {
+        s->expected_total = crc32_combine(s->expected_total, expected_crc, member_size);
+        return 0;
     }
     
-    return 0;
+    return check_crc(s, expected_crc);
 }
 
 /*
- * Read and validate gzip header
+ * Read and validate a gzip member header through the bit reader.
+ * Returns 1 if what follows a previous member is not a header.
  */
-int read_header(FILE *fp)
+static int read_header(struct gz_inflate *s, int first)
 {
     unsigned char buf[10];
     unsigned char flags;
@@ -533,22 +1067,26 @@ int read_header(FILE *fp)
     int xlen, i, c;
     
     /* Read the 10-byte header */
-    if (fread(buf, 1, 10, fp) != 10) {
-        fprintf(stderr, "Error: Cannot read header\n");
-        return -1;
+    for (i = 0; i < 10; i++) {
+        if ((c = getbits(s, 8)) < 0)
+            break;
+        buf[i] = c;
     }
     
     /* Check magic number */
+    if (!first && (i < 10 || buf[0] != GZIP_MAGIC1 || buf[1] != GZIP_MAGIC2))
+        return 1;
+    if (i < 10)
+        return fail(s, "Cannot read header");
     if (buf[0] != GZIP_MAGIC1 || buf[1] != GZIP_MAGIC2) {
-        fprintf(stderr, "Error: Not a gzip file (magic %02x %02x)\n",
-                buf[0], buf[1]);
-        return -1;
+        sprintf(s->errbuf, "Not a gzip file (magic %02x %02x)", buf[0], buf[1]);
+        return fail(s, s->errbuf);
     }
     
     /* Check compression method */
     if (buf[2] != GZIP_DEFLATE) {
-        fprintf(stderr, "Error: Unknown compression method %d\n", buf[2]);
-        return -1;
+        sprintf(s->errbuf, "Unknown compression method %d", buf[2]);
+        return fail(s, s->errbuf);
     }
     
     flags = buf[3];
@@ -559,180 +1097,1376 @@ int read_header(FILE *fp)
             ((unsigned long)buf[6] << 16) |
             ((unsigned long)buf[7] << 24);
     
-    printf("GZIP Header Information:\n");
-    printf("  Magic:         0x%02x 0x%02x (valid)\n", buf[0], buf[1]);
-    printf("  Method:        %d (deflate)\n", buf[2]);
-    printf("  Flags:         0x%02x\n", flags);
-    if (flags & FTEXT)    printf("    - Text file\n");
-    if (flags & FHCRC)    printf("    - Header CRC present\n");
-    if (flags & FEXTRA)   printf("    - Extra field present\n");
-    if (flags & FNAME)    printf("    - Original filename present\n");
-    if (flags & FCOMMENT) printf("    - Comment present\n");
-    
-    printf("  Mod time:      %lu\n", mtime);
-    printf("  Extra flags:   0x%02x\n", buf[8]);
-    printf("  OS:            %d (%s)\n", buf[9], 
-           buf[9] < 14 ? os_names[buf[9]] : "unknown");
+    if (s->verbose) {
+        printf("%sGZIP Header Information:\n", first ? "" : "\n");
+        printf("  Magic:         0x%02x 0x%02x (valid)\n", buf[0], buf[1]);
+        printf("  Method:        %d (deflate)\n", buf[2]);
+        printf("  Flags:         0x%02x\n", flags);
+        if (flags & FTEXT)    printf("    - Text file\n");
+        if (flags & FHCRC)    printf("    - Header CRC present\n");
+        if (flags & FEXTRA)   printf("    - Extra field present\n");
+        if (flags & FNAME)    printf("    - Original filename present\n");
+        if (flags & FCOMMENT) printf("    - Comment present\n");
+        
+        printf("  Mod time:      %lu\n", mtime);
+        printf("  Extra flags:   0x%02x\n", buf[8]);
+        printf("  OS:            %d (%s)\n", buf[9], 
+               buf[9] < 14 ? os_names[buf[9]] : "unknown");
+    }
     
     /* Handle optional fields */
     
     /* Extra field */
     if (flags & FEXTRA) {
-        if (fread(buf, 1, 2, fp) != 2) {
-            fprintf(stderr, "Error: Cannot read extra field length\n");
-            return -1;
-        }
-        xlen = buf[0] | (buf[1] << 8);
-        printf("  Extra field:   %d bytes\n", xlen);
+        if ((c = getbits(s, 8)) < 0 || (xlen = getbits(s, 8)) < 0)
+            return fail(s, "Cannot read extra field length");
+        xlen = c | (xlen << 8);
+        if (s->verbose)
+            printf("  Extra field:   %d bytes\n", xlen);
         /* Skip extra field */
         for (i = 0; i < xlen; i++) {
-            if (getc(fp) == EOF) {
-                fprintf(stderr, "Error: Premature EOF in extra field\n");
-                return -1;
-            }
+            if (getbits(s, 8) < 0)
+                return fail(s, "Premature EOF in extra field");
         }
     }
     
     /* Original filename */
     if (flags & FNAME) {
-        printf("  Filename:      ");
-        while ((c = getc(fp)) != 0 && c != EOF) {
-            putchar(c);
-        }
-        printf("\n");
-        if (c == EOF) {
-            fprintf(stderr, "Error: Premature EOF in filename\n");
-            return -1;
+        if (s->verbose)
+            printf("  Filename:      ");
+        while ((c = getbits(s, 8)) > 0) {
+            if (s->verbose)
+                putchar(c);
         }
+        if (s->verbose)
+            printf("\n");
+        if (c < 0)
+            return fail(s, "Premature EOF in filename");
     }
     
     /* Comment */
     if (flags & FCOMMENT) {
-        printf("  Comment:       ");
-        while ((c = getc(fp)) != 0 && c != EOF) {
-            putchar(c);
-        }
-        printf("\n");
-        if (c == EOF) {
-            fprintf(stderr, "Error: Premature EOF in comment\n");
-            return -1;
+        if (s->verbose)
+            printf("  Comment:       ");
+        while ((c = getbits(s, 8)) > 0) {
+            if (s->verbose)
+                putchar(c);
         }
+        if (s->verbose)
+            printf("\n");
+        if (c < 0)
+            return fail(s, "Premature EOF in comment");
     }
     
     /* Header CRC */
     if (flags & FHCRC) {
-        if (fread(buf, 1, 2, fp) != 2) {
-            fprintf(stderr, "Error: Cannot read header CRC\n");
-            return -1;
-        }
-        printf("  Header CRC:    0x%02x%02x\n", buf[1], buf[0]);
+        if ((c = getbits(s, 8)) < 0 || (i = getbits(s, 8)) < 0)
+            return fail(s, "Cannot read header CRC");
+        if (s->verbose)
+            printf("  Header CRC:    0x%02x%02x\n", i, c);
     }
     
-    printf("\nHeader parsed successfully!\n");
-    printf("Compressed data starts at byte offset: %ld\n", ftell(fp));
+    if (s->verbose) {
+        printf("\nHeader parsed successfully!\n");
+        printf("Compressed data starts at byte offset: %ld\n", input_offset(s));
+    }
     
     return 0;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Check for another member after a trailer
+ */
+static int more_input(struct gz_inflate *s)
 {
-    FILE *outfile;
-    char *outname;
-    int len;
+    return s->bitcount > 0 || s->inptr < s->inend || fill_inbuf(s) > 0;
+}
+
+/*
+ * Start a gzip stream with the bit reader empty
+ */
+static void start_stream(struct gz_inflate *s)
+{
+    s->bitbuf = 0;
+    s->bitcount = 0;
+    s->inptr = s->inend = s->inbuf;
+    s->bytes_read = 0;
+    s->bytes_output = 0;
+    s->expected_total = 0;
+    s->error = NULL;
+    s->size_mismatch = 0;
+    s->garbage = 0;
+}
+
+/*
+ * Decompress each member in turn, checking its trailer, once the first
+ * header has been read.  Returns the number of members, or -1 on error.
+ */
+static int inflate_members(struct gz_inflate *s)
+{
+    int members = 0;
+    int status;
     
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <gzip-file>\n", argv[0]);
-        return 1;
+    for (;;) {
+        s->member_start = s->bytes_output;
+        s->crc = 0xffffffffL;
+        s->wpos = s->wstart = 0;
+        
+        if (inflate(s) != 0 || read_trailer(s) != 0)
+            return -1;
+        members++;
+        
+        if (!more_input(s))
+            break;
+        if ((status = read_header(s, 0)) < 0)
+            return -1;
+        if (status > 0) {
+            s->garbage = 1;
+            break;
+        }
     }
-    
-    infile = fopen(argv[1], "rb");
-    if (infile == NULL) {
-        perror(argv[1]);
-        return 1;
+    return (s->error != NULL) ? -1 : members;
+}
+
+/*
+ * Forget the last stream and any settings, leaving the context ready
+ * for the next
+ */
+void gz_inflate_reset(struct gz_inflate *s)
+{
+    s->pipelined = 0;
+    s->index_file = NULL;
+    s->index_deflate = NULL;
+    s->index_buf = NULL;
+    s->next_point = INDEX_SPAN;
+    s->npoints = 0;
+    s->extract_start = -1;
+    s->extract_end = -1;
+    s->stop_offset = -1;
+    s->verbose = 0;
+    s->progress = NULL;
+    start_stream(s);
+}
+
+/*
+ * Free a decompression context and its buffers
+ */
+void gz_inflate_free(struct gz_inflate *s)
+{
+    if (s == NULL)
+        return;
+    if (s->window) free(s->window);
+    if (s->inbuf) free(s->inbuf);
+    free(s);
+}
+
+/*
+ * Allocate a decompression context.  Returns NULL if memory runs out.
+ */
+struct gz_inflate *gz_inflate_init(void)
+{
+    struct gz_inflate *s;
+    
+    s = (struct gz_inflate *)calloc(1, sizeof(struct gz_inflate));
+    if (s == NULL)
+        return NULL;
+    
+    /* Allocate decompression and input buffers */
+    s->window = (unsigned char *)malloc((unsigned)OUTSIZE);
+    s->inbuf = (unsigned char *)malloc((unsigned)INBUFSIZ);
+    if (s->window == NULL || s->inbuf == NULL) {
+        gz_inflate_free(s);
+        return NULL;
     }
+    gz_inflate_reset(s);
+    return s;
+}
+
+/*
+ * Decompress every member read through the read callback, writing the
+ * output through the write callback.  Returns -1 on error.
+ */
+int gz_inflate_stream(struct gz_inflate *s, gz_read_func reader, void *read_arg,
+                      gz_write_func writer, void *write_arg)
+{
+    s->read = reader;
+    s->read_arg = read_arg;
+    s->write = writer;
+    s->write_arg = write_arg;
     
-    /* Get compressed file size for progress tracking */
-    fseek(infile, 0L, 2);  /* SEEK_END */
-    compressed_size = ftell(infile);
-    fseek(infile, 0L, 0);  /* SEEK_SET */
-    bytes_output = 0;
-    progress_counter = 0;
-    
-    if (read_header(infile) != 0) {
-        fclose(infile);
-        return 1;
-    }
+    start_stream(s);
+    if (read_header(s, 1) != 0 || inflate_members(s) < 0)
+        return -1;
+    return 0;
+}
+
+/* A memory buffer written through the write callback */
+struct membuf {
+    unsigned char *next;
+    long left;
+};
+
+static int write_mem(void *arg, unsigned char *buf, unsigned int len)
+{
+    struct membuf *m = (struct membuf *)arg;
+    
+    if ((long)len > m->left)
+        return -1;
+    memcpy(m->next, buf, len);
+    m->next += len;
+    m->left -= len;
+    return 0;
+}
+
+/*
+ * Decompress the gzip data of srclen bytes at src into dst.  Returns the
+ * length of the output, or -1 on error or if it does not fit in dstlen
+ * bytes.
+ */
+long gz_inflate_buffer(struct gz_inflate *s, unsigned char *src, long srclen,
+                       unsigned char *dst, long dstlen)
+{
+    struct membuf out;
+    
+    out.next = dst;
+    out.left = dstlen;
+    s->read = NULL;
+    s->write = write_mem;
+    s->write_arg = &out;
+    
+    /* The bit reader reads the source in place */
+    start_stream(s);
+    s->inptr = src;
+    s->inend = src + srclen;
+    s->bytes_read = srclen;
+    
+    if (read_header(s, 1) != 0 || inflate_members(s) < 0)
+        return -1;
+    return dstlen - out.left;
+}
+
+/*
+ * What went wrong with the last stream
+ */
+char *gz_inflate_error(struct gz_inflate *s)
+{
+    return (s->error != NULL) ? s->error : "Invalid compressed data";
+}
+
+#ifndef GZ_LIBRARY
+/*
+ * The gunzip command, on top of a decompression context
+ */
+
+static FILE *infile = NULL;
+
+/* Options that apply to every file */
+static int to_stdout = 0;
+static int recursive = 0;
+static int pipelined = 0;
+static int make_index = 0;
+static int quiet = 0;           /* No progress lines */
+
+/* With -i, what compresses the windows of every index written */
+static struct gz_deflate *window_deflate = NULL;
+static unsigned char *window_buf = NULL;
+
+/* Batch mode: with -P, process batch_index of batch_workers takes
+ * every batch_workers-th file of the nfiles seen */
+static int batch_workers = 1;
+static int batch_index = 0;
+static long nfiles = 0;
+
+/* Compressed size for progress reporting, or -1 if it is unknown */
+static long compressed_size = 0;
+
+#ifdef USE_MMAP
+/* Mapping of the whole input, which the bit reader reads in place */
+static unsigned char *map_base = NULL;
+#endif
+
+/* Pipelined mode: reader and writer processes around the decoder */
+static pid_t reader_pid = -1;
+static pid_t writer_pid = -1;
+static int crc_fd = -1;         /* Writer sends its CRC back here */
+
+/*
+ * Parallel mode: the last WSIZE bytes written, and the CRC and length
+ * of the current member so far
+ */
+static unsigned char *tail = NULL;
+static unsigned int tail_pos = 0;
+static unsigned long member_crc = 0;
+static long member_len = 0;
+static long total_output = 0;
+
+/*
+ * What a decoded segment sends back: one report for each member that
+ * ends inside it, then one for where it stopped
+ */
+struct report {
+    int last;                   /* Segment stops here */
+    int next;                   /* For last, kind of position that follows */
+    long offset;                /* For last, input offset of that position */
+    unsigned long crc;          /* Finished CRC of output since last report */
+    long len;                   /* Length of that output */
+    unsigned long tcrc, tsize;  /* Trailer of the member that ended */
+};
+
+static int read_file(void *arg, unsigned char *buf, unsigned int len)
+{
+    FILE *fp = (FILE *)arg;
+    int n;
+    
+    n = fread(buf, 1, len, fp);
+    return (n == 0 && ferror(fp)) ? -1 : n;
+}
+
+static int write_file(void *arg, unsigned char *buf, unsigned int len)
+{
+    return (fwrite(buf, 1, len, (FILE *)arg) == len) ? 0 : -1;
+}
+
+/*
+ * Show how far through the input decoding has got, as a percentage if
+ * the input size is known
+ */
+static void report_progress(long done)
+{
+    if (quiet)
+        return;
+    if (compressed_size > 0) {
+        fprintf(stderr, "\rDecompressing: %d%% (%ld/%ld bytes)", 
+                (int)((done * 100L) / compressed_size), done, compressed_size);
+    }
+    else if (compressed_size < 0)
+        fprintf(stderr, "\rDecompressing: %ld bytes", done);
+}
+
+/*
+ * Say what went wrong, if the decoder knows, and what failed
+ */
+static void report_failure(struct gz_inflate *s, char *what)
+{
+    if (s->error != NULL)
+        fprintf(stderr, "\nError: %s", s->error);
+    fprintf(stderr, "\n%s failed\n", what);
+}
+
+#ifdef USE_MMAP
+/*
+ * Map the whole input and point the bit reader at it, leaving the file
+ * at its end so that fill_inbuf() finds nothing more.  Input that
+ * cannot be mapped is read through stdio.
+ */
+static void map_input(struct gz_inflate *s)
+{
+    unsigned char *p;
+    
+    if (compressed_size <= 0)
+        return;
+    p = mmap(NULL, (size_t)compressed_size, PROT_READ, MAP_PRIVATE,
+             fileno(infile), 0);
+    if (p == MAP_FAILED)
+        return;
+#ifdef MADV_SEQUENTIAL
+    madvise(p, (size_t)compressed_size, MADV_SEQUENTIAL);
+#endif
+    
+    map_base = p;
+    s->inptr = map_base;
+    s->inend = map_base + compressed_size;
+    s->bytes_read = compressed_size;
+    fseek(infile, 0L, 2);  /* SEEK_END */
+}
+
+/*
+ * Drop the input mapping
+ */
+static void unmap_input(void)
+{
+    if (map_base != NULL)
+        munmap(map_base, (size_t)compressed_size);
+    map_base = NULL;
+}
+#endif
+
+/*
+ * Start a reader process that copies the named file from offset into a
+ * pipe, and decode from the pipe instead.  With no name the reader
+ * carries on from where the decoder stopped reading infile.  The reader
+ * uses the window as its buffer.
+ */
+static int start_reader(struct gz_inflate *s, char *name, long offset)
+{
+    FILE *in;
+    int pfd[2];
+    int n;
+    
+    if (pipe(pfd) < 0)
+        return -1;
+    
+    fflush(stdout);
+    fflush(stderr);
+    reader_pid = fork();
+    if (reader_pid < 0) {
+        close(pfd[0]);
+        close(pfd[1]);
+        return -1;
+    }
+    
+    if (reader_pid == 0) {
+        close(pfd[0]);
+        in = infile;
+        if (name != NULL &&
+            ((in = fopen(name, "rb")) == NULL || fseek(in, offset, 0) != 0))
+            _exit(1);
+        while ((n = fread(s->window, 1, WSIZE, in)) > 0) {
+            if (write(pfd[1], s->window, n) != n)
+                _exit(1);
+        }
+        _exit(ferror(in) ? 1 : 0);
+    }
+    
+    close(pfd[1]);
+    if (infile != NULL)
+        fclose(infile);
+    infile = fdopen(pfd[0], "rb");
+    s->read_arg = infile;
+    if (infile == NULL) {
+        close(pfd[0]);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Start a writer process that checksums and writes everything sent down
+ * the returned stream to outfile.  Must be started after the reader, so
+ * that the reader does not hold the writer's pipe open.
+ */
+static FILE *start_writer(struct gz_inflate *s, FILE *outfile)
+{
+    FILE *out;
+    unsigned char buf[4];
+    unsigned long c;
+    int pfd[2], cfd[2];
+    int n, i;
+    
+    if (pipe(pfd) < 0)
+        return NULL;
+    if (pipe(cfd) < 0) {
+        close(pfd[0]);
+        close(pfd[1]);
+        return NULL;
+    }
+    
+    fflush(stdout);
+    fflush(stderr);
+    fflush(outfile);
+    writer_pid = fork();
+    if (writer_pid < 0) {
+        close(pfd[0]);
+        close(pfd[1]);
+        close(cfd[0]);
+        close(cfd[1]);
+        return NULL;
+    }
+    
+    if (writer_pid == 0) {
+        close(pfd[1]);
+        close(cfd[0]);
+        close(fileno(infile));
+        c = 0xffffffffL;
+        while ((n = read(pfd[0], s->window, WSIZE)) > 0) {
+            c = update_crc(c, s->window, n);
+            if ((int)fwrite(s->window, 1, n, outfile) != n)
+                _exit(1);
+        }
+        if (n < 0 || fflush(outfile) != 0)
+            _exit(1);
+        for (i = 0; i < 4; i++)
+            buf[i] = (unsigned char)(c >> (i * 8));
+        _exit(write(cfd[1], buf, 4) == 4 ? 0 : 1);
+    }
+    
+    close(pfd[0]);
+    close(cfd[1]);
+    crc_fd = cfd[0];
+    out = fdopen(pfd[1], "wb");
+    if (out == NULL)
+        close(pfd[1]);      /* finish_writer() still reaps the writer */
+    return out;
+}
+
+/*
+ * Close the writer's stream, wait for it to finish and pick up the
+ * CRC of what it wrote.  Returns -1 if any of the output was lost, or
+ * if the writer never started.  Also used after a failure, to stop the
+ * writer; out is NULL if its stream could not be opened.
+ */
+static int finish_writer(struct gz_inflate *s, FILE *out)
+{
+    unsigned char buf[4];
+    int status, ok;
+    
+    if (writer_pid < 0)
+        return -1;
+    ok = (out != NULL && fclose(out) == 0);
+    ok = (read(crc_fd, buf, 4) == 4) && ok;
+    close(crc_fd);
+    ok = (waitpid(writer_pid, &status, 0) == writer_pid) && ok;
+    writer_pid = -1;
+    crc_fd = -1;
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    
+    s->crc = (unsigned long)buf[0] | ((unsigned long)buf[1] << 8) |
+             ((unsigned long)buf[2] << 16) | ((unsigned long)buf[3] << 24);
+    return 0;
+}
+
+/*
+ * Read an n-byte little-endian number from the index.  Bytes beyond
+ * what an unsigned long holds must be zero.
+ */
+static int get_number(FILE *fp, unsigned long *v, int n)
+{
+    unsigned long x = 0;
+    int i, c;
+    
+    for (i = 0; i < n; i++) {
+        c = getc(fp);
+        if (c == EOF)
+            return -1;
+        if (i < (int)sizeof(unsigned long))
+            x |= (unsigned long)c << (8 * i);
+        else if (c != 0)
+            return -1;
+    }
+    *v = x;
+    return 0;
+}
+
+/*
+ * Write length bytes of output starting at offset to stdout, decoding
+ * from the last access point in the file's index at or before offset
+ */
+static int extract_range(char *inname, long offset, long length)
+{
+    struct gz_inflate *s;
+    FILE *idx;
+    char *idxname;
+    char magic[4];
+    unsigned long size, start, out, in, len;
+    unsigned long best_out = 0, best_in, best_len = 0;
+    unsigned char *packed;
+    long best_pos = -1;
+    int bits, best_bits = 0;
+    int c;
+    
+    idxname = malloc(strlen(inname) + 5);
+    s = gz_inflate_init();
+    if (idxname == NULL || s == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    sprintf(idxname, "%s.idx", inname);
+    
+    idx = fopen(idxname, "rb");
+    if (idx == NULL) {
+        perror(idxname);
+        return -1;
+    }
+    if (fread(magic, 1, 4, idx) != 4 || memcmp(magic, INDEX_MAGIC, 4) != 0 ||
+        get_number(idx, &size, 8) != 0 || get_number(idx, &start, 8) != 0) {
+        fprintf(stderr, "Error: %s is not a gzip index\n", idxname);
+        return -1;
+    }
+    
+    infile = fopen(inname, "rb");
+    if (infile == NULL) {
+        perror(inname);
+        return -1;
+    }
+    fseek(infile, 0L, 2);  /* SEEK_END */
+    if ((unsigned long)ftell(infile) != size) {
+        fprintf(stderr, "Error: %s is out of date\n", idxname);
+        return -1;
+    }
+    
+    /* Find the last access point at or before offset */
+    best_in = start;
+    while (get_number(idx, &out, 8) == 0 && out <= (unsigned long)offset) {
+        if (get_number(idx, &in, 8) != 0 || (bits = getc(idx)) == EOF ||
+            get_number(idx, &len, 4) != 0 || len > INDEX_WINDOW) {
+            fprintf(stderr, "Error: %s is corrupt\n", idxname);
+            return -1;
+        }
+        best_out = out;
+        best_in = in;
+        best_bits = bits;
+        best_len = len;
+        best_pos = ftell(idx);
+        fseek(idx, (long)len, 1);  /* SEEK_CUR */
+    }
+    
+    /* Restore its window.  The context that then decodes the range
+     * decompresses it, into a buffer after the packed window since it
+     * decodes through its own window. */
+    s->wpos = s->wstart = 0;
+    if (best_pos >= 0) {
+        packed = (unsigned char *)malloc((unsigned)(best_len + WSIZE));
+        if (packed == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return -1;
+        }
+        fseek(idx, best_pos, 0);  /* SEEK_SET */
+        if (fread(packed, 1, (size_t)best_len, idx) != best_len ||
+            gz_inflate_buffer(s, packed, (long)best_len, packed + best_len,
+                              (long)WSIZE) != WSIZE) {
+            fprintf(stderr, "Error: %s is corrupt\n", idxname);
+            return -1;
+        }
+        gz_inflate_reset(s);
+        memcpy(s->window, packed + best_len, WSIZE);
+        free(packed);
+        s->wpos = s->wstart = WSIZE;
+    }
+    fclose(idx);
+    
+    /* Start the bit reader partway through the byte before best_in */
+    if (best_bits > 0) {
+        fseek(infile, (long)best_in - 1, 0);  /* SEEK_SET */
+        if ((c = getc(infile)) == EOF) {
+            fprintf(stderr, "Error: %s is corrupt\n", idxname);
+            return -1;
+        }
+        s->bitbuf = (unsigned long)c >> (8 - best_bits);
+        s->bitcount = best_bits;
+    }
+    else
+        fseek(infile, (long)best_in, 0);  /* SEEK_SET */
+    s->bytes_read = (long)best_in;
+    s->bytes_output = (long)best_out;
+    s->read = read_file;
+    s->read_arg = infile;
+    s->write = write_file;
+    s->write_arg = stdout;
+    
+    /* Decode quietly up to the end of the range */
+    s->extract_start = offset;
+    s->extract_end = offset + length;
+    
+    /* Carry on into following members until the range is written */
+    for (;;) {
+        if (inflate(s) != 0) {
+            report_failure(s, "Extraction");
+            return -1;
+        }
+        if (s->bytes_output >= s->extract_end)
+            break;
+        
+        /* Skip the trailer */
+        alignbits(s);
+        for (c = 0; c < 8; c++)
+            getbits(s, 8);
+        if (!more_input(s) || read_header(s, 0) != 0)
+            break;
+        s->wpos = s->wstart = 0;
+    }
+    
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        perror("stdout");
+        return -1;
+    }
+    
+    fclose(infile);
+    gz_inflate_free(s);
+    free(idxname);
+    return 0;
+}
+
+/*
+ * Find where independent segments of the input may start: a gzip
+ * header, or the block after an empty stored block, which is how a
+ * full flush ends.  Each of up to max evenly spaced spans gives its
+ * first header, or failing that its first flush, since a sync flush
+ * looks the same but may be followed by references to earlier output.
+ * Matches may be false; decoding from them fails or is not used.
+ * Returns the number of segments, the first being the start of the
+ * file.
+ */
+static int find_segments(long *start, int *kind, int max)
+{
+    unsigned long last;
+    long span, pos, end, header, flush;
+    int n = 1, k, c;
+    
+    start[0] = 0;
+    kind[0] = SEG_HEADER;
+    span = compressed_size / max;
+    if (span < SEGMENT_MIN)
+        span = SEGMENT_MIN;
+    
+    for (k = 1; k < max && k * span < compressed_size; k++) {
+        pos = k * span;
+        end = pos + span;
+        fseek(infile, pos, 0);  /* SEEK_SET */
+        last = 0;
+        header = flush = -1;
+        while (pos < end && (c = getc(infile)) != EOF) {
+            last = ((last << 8) | (unsigned long)c) & 0xffffffffL;
+            pos++;
+            
+            /* LEN and NLEN of an empty stored block */
+            if (last == 0xffffL && pos - k * span >= 4 && flush < 0)
+                flush = pos;
+            
+            /* Magic, deflate method and valid flags */
+            if ((last >> 8) == 0x1f8b08L && (c & 0xe0) == 0) {
+                header = pos - 4;
+                break;
+            }
+        }
+        if (header >= 0) {
+            start[n] = header;
+            kind[n++] = SEG_HEADER;
+        }
+        else if (flush >= 0) {
+            start[n] = flush;
+            kind[n++] = SEG_BLOCK;
+        }
+    }
+    return n;
+}
+
+/*
+ * Decode the input from offset start, a position of the given kind, to
+ * out, until a member end or full flush at or after stop, or the end
+ * of the gzip data if stop is -1.  The window must already hold any
+ * history the segment refers to.  Reports go to rep, one for each
+ * member that ends in the segment and a last one for where it stopped.
+ */
+static int decode_segment(struct gz_inflate *s, long start, int kind, long stop,
+                          FILE *out, FILE *rep)
+{
+    struct report r;
+    int status;
+    
+    fseek(infile, start, 0);  /* SEEK_SET */
+    start_stream(s);
+    s->read_arg = infile;
+    s->write_arg = out;
+    s->bytes_read = start;
+    s->stop_offset = stop;
+    memset(&r, 0, sizeof(r));
+    r.last = 1;
+    r.offset = start;
+    r.next = SEG_EOF;
+    
+    status = (kind == SEG_HEADER) ? read_header(s, 0) : 0;
+    if (status < 0)
+        return -1;
+    
+    while (status == 0) {
+        s->crc = 0xffffffffL;
+        s->member_start = s->bytes_output;
+        if ((status = inflate(s)) < 0)
+            return -1;
+        r.crc = s->crc ^ 0xffffffffL;
+        r.len = s->bytes_output - s->member_start;
+        
+        /* Stopped at a full flush */
+        if (status == 1) {
+            r.next = SEG_BLOCK;
+            r.offset = input_offset(s);
+            break;
+        }
+        
+        r.last = 0;
+        if (get_trailer(s, &r.tcrc, &r.tsize) != 0 ||
+            fwrite(&r, sizeof(r), 1, rep) != 1)
+            return -1;
+        
+        /* Carry on into the next member unless it is far enough */
+        r.last = 1;
+        r.crc = 0;
+        r.len = 0;
+        r.offset = input_offset(s);
+        r.next = SEG_EOF;
+        s->wpos = s->wstart = 0;
+        if (!more_input(s))
+            break;
+        r.next = SEG_HEADER;
+        if (stop >= 0 && r.offset >= stop)
+            break;
+        if ((status = read_header(s, 0)) < 0)
+            return -1;
+        if (status > 0)
+            r.next = SEG_EOF;
+    }
+    
+    if (fwrite(&r, sizeof(r), 1, rep) != 1 ||
+        fflush(rep) != 0 || fflush(out) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Copy a decoded segment to outfile, keeping the last WSIZE bytes in
+ * tail, and check the trailers of the members it ends.  Sets *pos and
+ * *kind to where the segment stopped.  Returns the number of members
+ * ended, or -1 if one fails its check.
+ */
+static int accept_segment(struct gz_inflate *s, FILE *data, FILE *rep,
+                          FILE *outfile, long *pos, int *kind)
+{
+    struct report r;
+    unsigned int n;
+    int members = 0;
+    
+    rewind(data);
+    while ((n = fread(tail + tail_pos, 1, WSIZE - tail_pos, data)) > 0) {
+        if (fwrite(tail + tail_pos, 1, n, outfile) != n)
+            return -1;
+        tail_pos = (tail_pos + n) % WSIZE;
+        total_output += n;
+    }
+    
+    rewind(rep);
+    do {
+        if (fread(&r, sizeof(r), 1, rep) != 1)
+            return fail(s, "Lost a decoded segment");
+        member_crc = crc32_combine(member_crc, r.crc, r.len);
+        member_len += r.len;
+        if (!r.last) {
+            if ((r.tsize & 0xffffffffL) != (member_len & 0xffffffffL))
+                fprintf(stderr, "Warning: Size mismatch (modulo 2^32)\n");
+            s->crc = member_crc ^ 0xffffffffL;
+            if (check_crc(s, r.tcrc) != 0)
+                return -1;
+            member_crc = 0;
+            member_len = 0;
+            members++;
+        }
+    } while (!r.last);
+    
+    *pos = r.offset;
+    *kind = r.next;
+    return members;
+}
+
+/*
+ * Load the window with the output of the current member from tail, so
+ * that decoding can resume after a flush
+ */
+static void prime_window(struct gz_inflate *s)
+{
+    unsigned int n, from, first;
+    
+    n = (member_len < (long)WSIZE) ? (unsigned int)member_len : WSIZE;
+    from = (tail_pos + WSIZE - n) % WSIZE;
+    first = (n < WSIZE - from) ? n : WSIZE - from;
+    memcpy(s->window, tail + from, first);
+    memcpy(s->window + first, tail, n - first);
+    s->wpos = s->wstart = n;
+}
+
+/*
+ * Decompress with up to nworkers processes, each decoding one segment
+ * of the input with its own window into a temporary file.  Segments are
+ * taken in order when they start where the previous one stopped; any
+ * gap left by a false start, or by a flush that still refers to earlier
+ * output, is decoded here with the window primed from the output so
+ * far.  Returns the number of members, or -1 on error.
+ */
+static int decompress_parallel(struct gz_inflate *s, char *inname, FILE *outfile,
+                               int nworkers)
+{
+    long start[MAX_WORKERS * SEGMENTS];
+    int kind[MAX_WORKERS * SEGMENTS];
+    pid_t pids[MAX_WORKERS];
+    FILE *data[MAX_WORKERS], *rep[MAX_WORKERS];
+    FILE *gdata, *grep;
+    long pos = 0;
+    int at = SEG_HEADER;
+    int nseg, next, k, slot, status, n;
+    int members = 0, failed = 0;
+    
+    tail = (unsigned char *)malloc((unsigned)WSIZE);
+    if (tail == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    s->verbose = 0;
+    s->progress = NULL;
+    total_output = 0;
+    nseg = find_segments(start, kind, nworkers * SEGMENTS);
+    
+    fflush(outfile);
+    fflush(stdout);
+    fflush(stderr);
+    
+    for (k = 0, next = 0; k <= nseg; k++) {
+        /* Keep every worker busy on the segments that follow */
+        while (!failed && next < nseg && next < k + nworkers) {
+            slot = next % nworkers;
+            data[slot] = tmpfile();
+            rep[slot] = tmpfile();
+            pids[slot] = -1;
+            if (data[slot] == NULL || rep[slot] == NULL)
+                perror("tmpfile");
+            else if ((pids[slot] = fork()) < 0)
+                perror("fork");
+            if (pids[slot] < 0) {
+                /* Workers already started are reaped below */
+                if (data[slot] != NULL)
+                    fclose(data[slot]);
+                if (rep[slot] != NULL)
+                    fclose(rep[slot]);
+                failed = 1;
+                break;
+            }
+            if (pids[slot] == 0) {
+                /* Segments may start at false matches, so errors here
+                 * are expected; real ones show when the gap is decoded */
+                infile = fopen(inname, "rb");
+                s->wpos = s->wstart = 0;
+                _exit(infile == NULL ||
+                      decode_segment(s, start[next], kind[next],
+                                     next + 1 < nseg ? start[next + 1] : -1,
+                                     data[slot], rep[slot]) != 0);
+            }
+            next++;
+        }
+        
+        /* Decode up to the segment here if the last one stopped short */
+        if (!failed && at != SEG_EOF && (k == nseg || start[k] > pos)) {
+            gdata = tmpfile();
+            grep = tmpfile();
+            if (gdata == NULL || grep == NULL) {
+                perror("tmpfile");
+                failed = 1;
+            }
+            else {
+                if (at == SEG_BLOCK)
+                    prime_window(s);
+                else
+                    s->wpos = s->wstart = 0;
+                if (decode_segment(s, pos, at, k < nseg ? start[k] : -1,
+                                   gdata, grep) != 0 ||
+                    (n = accept_segment(s, gdata, grep, outfile, &pos, &at)) < 0)
+                    failed = 1;
+                else
+                    members += n;
+            }
+            if (gdata != NULL)
+                fclose(gdata);
+            if (grep != NULL)
+                fclose(grep);
+        }
+        
+        /* After a failure, stop once every started worker is reaped */
+        if (k == nseg || k == next)
+            break;
+        
+        /* Take the worker's segment if it carries on from there */
+        slot = k % nworkers;
+        if (waitpid(pids[slot], &status, 0) == pids[slot] &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0 && !failed &&
+            at != SEG_EOF && start[k] == pos && kind[k] == at) {
+            if ((n = accept_segment(s, data[slot], rep[slot], outfile,
+                                    &pos, &at)) < 0)
+                failed = 1;
+            else
+                members += n;
+        }
+        fclose(data[slot]);
+        fclose(rep[slot]);
+        
+        if (!failed)
+            report_progress(pos);
+    }
+    
+    free(tail);
+    if (failed) {
+        report_failure(s, "Decompression");
+        return -1;
+    }
+    if (pos < compressed_size)
+        fprintf(stderr, "\nWarning: Trailing garbage ignored\n");
+    s->bytes_output = total_output;
+    return members;
+}
+
+/*
+ * Decompress or index one file with the context.  Returns nonzero on
+ * failure.
+ */
+static int decompress_file(struct gz_inflate *s, char *inname, int nworkers)
+{
+    FILE *outfile, *out, *msg;
+    char *outname;
+    int len;
+    int from_stdin, use_stdout;
+    int members = 0;
+    int status = 0;
+    
+    /* Standard input goes to standard output, and cannot be read by
+     * parallel workers */
+    from_stdin = (strcmp(inname, "-") == 0);
+    use_stdout = to_stdout || from_stdin;
+    if (from_stdin) {
+        infile = stdin;
+        nworkers = 0;
+    }
+    else {
+        infile = fopen(inname, "rb");
+        if (infile == NULL) {
+            perror(inname);
+            return 1;
+        }
+    }
+    
+    /* Get compressed file size for progress tracking, or -1 if the
+     * input cannot seek */
+    compressed_size = -1;
+    if (ftell(infile) == 0 && fseek(infile, 0L, 2) == 0) {  /* SEEK_END */
+        compressed_size = ftell(infile);
+        fseek(infile, 0L, 0);  /* SEEK_SET */
+    }
+    
+    /* Reuse the context, clearing what the last file left in it */
+    gz_inflate_reset(s);
+    s->read = read_file;
+    s->read_arg = infile;
+    s->progress = quiet ? NULL : report_progress;
+    s->pipelined = pipelined;
+    s->verbose = !use_stdout;
+#ifdef USE_MMAP
+    /* Other modes read the file again from their own processes */
+    if (!pipelined && nworkers == 0)
+        map_input(s);
+#endif
+    
+    /* Headers are read through the bit reader, so that members after
+     * the first come from the same buffer */
+    if (read_header(s, 1) != 0) {
+        fprintf(stderr, "%s: %s\n", inname, gz_inflate_error(s));
+#ifdef USE_MMAP
+        unmap_input();
+#endif
+        if (infile != stdin)
+            fclose(infile);
+        return 1;
+    }
     
     /* Create output filename (remove .gz extension) */
-    len = strlen(argv[1]);
-    if (len > 3 && strcmp(argv[1] + len - 3, ".gz") == 0) {
+    len = strlen(inname);
+    if (use_stdout) {
+        outname = malloc(16);
+        strcpy(outname, "standard output");
+    } else if (make_index) {
+        outname = malloc(len + 5);
+        sprintf(outname, "%s.idx", inname);
+    } else if (len > 3 && strcmp(inname + len - 3, ".gz") == 0) {
         outname = malloc(len - 2);
-        strncpy(outname, argv[1], len - 3);
+        strncpy(outname, inname, len - 3);
         outname[len - 3] = '\0';
     } else {
         outname = malloc(len + 5);
-        sprintf(outname, "%s.out", argv[1]);
+        sprintf(outname, "%s.out", inname);
     }
     
-    printf("\nDecompressing to: %s\n", outname);
+    /* Keep standard output for the data */
+    msg = use_stdout ? stderr : stdout;
+    fprintf(msg, "\n%s to: %s\n", make_index ? "Indexing" : "Decompressing",
+            outname);
     
-    outfile = fopen(outname, "wb");
+    outfile = use_stdout ? stdout : fopen(outname, "wb");
     if (outfile == NULL) {
         perror(outname);
         free(outname);
-        fclose(infile);
+#ifdef USE_MMAP
+        unmap_input();
+#endif
+        if (infile != stdin)
+            fclose(infile);
         return 1;
     }
     
-    /* Allocate decompression window */
-    window = (unsigned char *)malloc((unsigned)WSIZE);
-    if (window == NULL) {
-        fprintf(stderr, "Error: Cannot allocate 32KB window (out of memory)\n");
-        fclose(outfile);
-        fclose(infile);
-        free(outname);
-        return 1;
+    /* Hand reading and writing to their own processes */
+    out = outfile;
+    s->write = write_file;
+    s->write_arg = outfile;
+    if (make_index) {
+        s->index_file = outfile;
+        s->index_deflate = window_deflate;
+        s->index_buf = window_buf;
+        fwrite(INDEX_MAGIC, 1, 4, s->index_file);
+        put_number(s->index_file, (unsigned long)compressed_size, 8);
+        put_number(s->index_file, (unsigned long)input_offset(s), 8);
+        s->write = NULL;
+    }
+    else if (pipelined) {
+        if (start_reader(s, from_stdin ? NULL : inname, s->bytes_read) != 0 ||
+            (out = start_writer(s, outfile)) == NULL) {
+            perror("Cannot start pipeline");
+            status = -1;
+        }
+        s->write_arg = out;
     }
     
-    /* Initialize decompression state */
-    bitbuf = 0;
-    bitcount = 0;
-    wpos = 0;
-    memset(window, 0, (unsigned)WSIZE);
+    /* Decompress each member in turn, checking its trailer */
+    if (status < 0)
+        members = -1;
+    else if (nworkers > 0)
+        members = decompress_parallel(s, inname, outfile, nworkers);
+    else {
+        members = inflate_members(s);
+        if (members < 0)
+            report_failure(s, "Decompression");
+        if (s->size_mismatch)
+            fprintf(stderr, "\nWarning: Size mismatch (modulo 2^32)\n");
+        if (s->garbage)
+            fprintf(stderr, "\nWarning: Trailing garbage ignored\n");
+    }
+    if (members < 0)
+        status = -1;
+    
+    /* Make sure the output actually reached the file.  The writer is
+     * closed and reaped even after a failure. */
+    if (pipelined) {
+        if (finish_writer(s, out) != 0 && status >= 0) {
+            perror(outname);
+            status = -1;
+        }
+    }
+    else if (status >= 0 && (fflush(outfile) != 0 || ferror(outfile))) {
+        perror(outname);
+        status = -1;
+    }
     
-    /* Initialize CRC */
-    make_crc_table();
-    crc = 0xffffffffL;
-    bytes_output = 0;
+    /* The writer's CRC covers all members */
+    if (status >= 0 && pipelined && check_crc(s, s->expected_total) != 0) {
+        fprintf(stderr, "\nError: %s\n", s->error);
+        status = -1;
+    }
     
-    /* Decompress */
-    if (inflate(outfile) != 0) {
-        fprintf(stderr, "\nDecompression failed\n");
+#ifdef USE_MMAP
+    unmap_input();
+#endif
+    if (status >= 0) {
+        /* Clear progress line and show completion */
+        if (!quiet && compressed_size < 0)
+            fprintf(stderr, "\rDecompressing: %ld bytes\n", s->bytes_read);
+        else if (!quiet)
+            fprintf(stderr, "\rDecompressing: 100%% (%ld/%ld bytes)\n",
+                    compressed_size, compressed_size);
+    
+        if (make_index)
+            fprintf(msg, "Index written: %d access points over %ld bytes (CRC OK)\n",
+                    s->npoints, s->bytes_output);
+        else if (members > 1)
+            fprintf(msg, "Decompression successful! Output: %ld bytes from %d members (CRC OK)\n",
+                    s->bytes_output, members);
+        else
+            fprintf(msg, "Decompression successful! Output: %ld bytes (CRC OK)\n",
+                    s->bytes_output);
+    }
+    
+    /* Closing the pipe first stops a reader that is still sending */
+    if (outfile != stdout)
         fclose(outfile);
-    free(window);
+    if (infile != NULL && infile != stdin)
         fclose(infile);
-        free(outname);
-        free(window);
+    if (reader_pid > 0)
+        waitpid(reader_pid, NULL, 0);
+    reader_pid = -1;
+    free(outname);
+    return status < 0;
+}
+
+/*
+ * Decompress a file, or with -r every .gz file under a directory.
+ * Returns nonzero if any file fails.
+ */
+static int decompress_path(struct gz_inflate *s, char *path, int nworkers, int top)
+{
+    struct stat st;
+    struct dirent *d;
+    DIR *dir;
+    char *sub;
+    int len, status = 0;
+    
+    if (strcmp(path, "-") != 0) {
+        if ((top ? stat(path, &st) : lstat(path, &st)) != 0) {
+            perror(path);
+            return 1;
+        }
+        if ((st.st_mode & S_IFMT) == S_IFDIR) {
+            if (!recursive) {
+                fprintf(stderr, "%s is a directory (use -r)\n", path);
+                return 1;
+            }
+            dir = opendir(path);
+            if (dir == NULL) {
+                perror(path);
+                return 1;
+            }
+            while ((d = readdir(dir)) != NULL) {
+                if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                    continue;
+                sub = malloc(strlen(path) + strlen(d->d_name) + 2);
+                if (sub == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    status = 1;
+                    break;
+                }
+                sprintf(sub, "%s/%s", path, d->d_name);
+                status |= decompress_path(s, sub, nworkers, 0);
+                free(sub);
+            }
+            closedir(dir);
+            return status;
+        }
+        if (!top) {
+            len = strlen(path);
+            if ((st.st_mode & S_IFMT) != S_IFREG ||
+                len <= 3 || strcmp(path + len - 3, ".gz") != 0)
+                return 0;
+        }
+    }
+    
+    /* With -P, take only this process's share */
+    if (nfiles++ % batch_workers != batch_index)
+        return 0;
+    return decompress_file(s, path, nworkers);
+}
+
+int main(int argc, char *argv[])
+{
+    struct gz_inflate *s;
+    static char *std_input[] = { "-" };
+    char **names;
+    int nnames;
+    pid_t pids[MAX_WORKERS];
+    int argn, k, n;
+    int extract = 0, nworkers = 0;
+    long offset = 0, length = 0;
+    int status = 0;
+    
+    for (argn = 1; argn < argc && argv[argn][0] == '-' && argv[argn][1]; argn++) {
+        if (strcmp(argv[argn], "-c") == 0)
+            to_stdout = 1;
+        else if (strcmp(argv[argn], "-r") == 0)
+            recursive = 1;
+        else if (strcmp(argv[argn], "-p") == 0)
+            pipelined = 1;
+        else if (strcmp(argv[argn], "-i") == 0)
+            make_index = 1;
+        else if ((strcmp(argv[argn], "-j") == 0 || strcmp(argv[argn], "-P") == 0) &&
+                 argn + 1 < argc) {
+            n = atoi(argv[argn + 1]);
+            if (n < 1 || n > MAX_WORKERS) {
+                fprintf(stderr, "Workers must be 1 to %d\n", MAX_WORKERS);
+                return 1;
+            }
+            if (argv[argn][1] == 'j')
+                nworkers = n;
+            else
+                batch_workers = n;
+            argn++;
+        }
+        else if (strcmp(argv[argn], "-x") == 0 && argn + 2 < argc) {
+            extract = 1;
+            offset = atol(argv[++argn]);
+            length = atol(argv[++argn]);
+        }
+        else
+            break;
+    }
+    names = (argn < argc) ? argv + argn : std_input;
+    nnames = (argn < argc) ? argc - argn : 1;
+    
+    /* Extraction reads one file at its index; files decompressed at
+     * once would mix on standard output */
+    if (pipelined + make_index + extract + (nworkers > 0) > 1 ||
+        (extract && (nnames != 1 || recursive || batch_workers > 1)) ||
+        (to_stdout && batch_workers > 1) ||
+        (strcmp(names[0], "-") == 0 && (make_index || extract)) ||
+        offset < 0 || length < 0) {
+        fprintf(stderr, "Usage: %s [-c] [-r] [-P workers] [-p | -j workers | -i] [<gzip-file>... | -]\n",
+                argv[0]);
+        fprintf(stderr, "       %s -x offset length <gzip-file>\n", argv[0]);
+        fprintf(stderr, "  -c writes to standard output; - or no file reads standard input\n");
+        fprintf(stderr, "  -r decompresses the .gz files under each directory\n");
+        fprintf(stderr, "  -P decompresses that many files at once in separate processes\n");
+        fprintf(stderr, "  -p reads, decodes and writes in separate processes\n");
+        fprintf(stderr, "  -j decodes members and full-flush segments in parallel\n");
+        fprintf(stderr, "  -i writes an index of access points to <gzip-file>.idx\n");
+        fprintf(stderr, "  -x writes length bytes from offset to stdout using the index\n");
         return 1;
     }
     
-    /* Clear progress line and show completion */
-    fprintf(stderr, "\rDecompressing: 100%% (%ld/%ld bytes)\n", 
-            compressed_size, compressed_size);
+    if (extract)
+        return (extract_range(names[0], offset, length) == 0) ? 0 : 1;
     
-    /* Read and verify trailer */
-    if (read_trailer(infile) != 0) {
-        fclose(outfile);
-        fclose(infile);
-        free(window);
-        free(outname);
+    /* One context serves every file this process decompresses */
+    s = gz_inflate_init();
+    if (s == NULL) {
+        fprintf(stderr, "Error: Cannot allocate %uKB output buffer (out of memory)\n",
+                OUTSIZE / 1024);
         return 1;
     }
+    if (make_index) {
+        window_deflate = gz_deflate_init(INDEX_LEVEL);
+        window_buf = (unsigned char *)malloc((unsigned)INDEX_WINDOW);
+        if (window_deflate == NULL || window_buf == NULL) {
+            fprintf(stderr, "Error: Cannot allocate index buffers (out of memory)\n");
+            gz_inflate_free(s);
+            gz_deflate_free(window_deflate);
+            free(window_buf);
+            return 1;
+        }
+    }
     
-    printf("Decompression successful! Output: %ld bytes (CRC OK)\n", bytes_output);
+    if (batch_workers == 1) {
+        for (k = 0; k < nnames; k++)
+            status |= decompress_path(s, names[k], nworkers, 1);
+    }
+    else {
+        /* Each process walks the same names and takes its share, so the
+         * progress lines would garble */
+        quiet = 1;
+        fflush(stdout);
+        fflush(stderr);
+        for (n = 0; n < batch_workers; n++) {
+            pids[n] = fork();
+            if (pids[n] < 0) {
+                perror("fork");
+                status = 1;
+                break;
+            }
+            if (pids[n] == 0) {
+                batch_index = n;
+                for (k = 0; k < nnames; k++)
+                    status |= decompress_path(s, names[k], nworkers, 1);
+                fflush(stdout);
+                _exit(status != 0);
+            }
+        }
+        while (n-- > 0) {
+            if (waitpid(pids[n], &k, 0) != pids[n] ||
+                !WIFEXITED(k) || WEXITSTATUS(k) != 0)
+                status = 1;
+        }
+    }
     
-    fclose(outfile);
-    fclose(infile);
-    free(outname);
-    return 0;
+    gz_inflate_free(s);
+    gz_deflate_free(window_deflate);
+    free(window_buf);
+    return status != 0;
 }
+#endif /* GZ_LIBRARY */
@@ -0,0 +1,50 @@
+/*
+ * gzip compression and decompression as a library
+ *
+ * Built from gzip.c and gunzip.c with GZ_LIBRARY defined (make libgz.a).
+ * A context holds the buffers and state for one stream at a time and
+ * can be reused for stream after stream without reallocating.  Contexts
+ * share only constant tables, so any thread may create and use its own
+ * contexts at any time; a single context must not be used by two
+ * threads at once.
+ */
+
+/*
+ * Stream callbacks.  A read function returns up to len bytes, 0 at the
+ * end of the input (and again if called after that) or -1 on error.  A
+ * write function takes all len bytes and returns 0, or -1 on error.
+ */
+typedef int (*gz_read_func)(void *arg, unsigned char *buf, unsigned int len);
+typedef int (*gz_write_func)(void *arg, unsigned char *buf, unsigned int len);
+
+struct gz_deflate;
+struct gz_inflate;
+
+/*
+ * Compression.  Each call writes one gzip member with no file name.
+ * Levels run from 0, fastest, to 10, smallest.
+ * gz_deflate_buffer() returns the compressed length, or -1 if it does
+ * not fit in dstlen bytes; gz_deflate_stream() returns 0 or -1.
+ */
+struct gz_deflate *gz_deflate_init(int level);
+int gz_deflate_reset(struct gz_deflate *s, int level);
+int gz_deflate_stream(struct gz_deflate *s, gz_read_func reader, void *read_arg,
+                      gz_write_func writer, void *write_arg);
+long gz_deflate_buffer(struct gz_deflate *s, unsigned char *src, long srclen,
+                       unsigned char *dst, long dstlen);
+void gz_deflate_free(struct gz_deflate *s);
+
+/*
+ * Decompression of every member of a gzip stream, checking each CRC.
+ * gz_inflate_buffer() returns the decompressed length, or -1 on error
+ * or if it does not fit in dstlen bytes; gz_inflate_stream() returns 0
+ * or -1.  After an error, gz_inflate_error() says what went wrong.
+ */
+struct gz_inflate *gz_inflate_init(void);
+void gz_inflate_reset(struct gz_inflate *s);
+int gz_inflate_stream(struct gz_inflate *s, gz_read_func reader, void *read_arg,
+                      gz_write_func writer, void *write_arg);
+long gz_inflate_buffer(struct gz_inflate *s, unsigned char *src, long srclen,
+                       unsigned char *dst, long dstlen);
+char *gz_inflate_error(struct gz_inflate *s);
+void gz_inflate_free(struct gz_inflate *s);
@@ -1,90 +1,355 @@
 /*
  * A *very* minimal gzip compressor for 2.11BSD
- * Fixed Huffman DEFLATE compression with 8KB window
+ * Fixed and dynamic Huffman DEFLATE compression with a 4KB window on
+ * the PDP-11 and the full 32KB window elsewhere
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef pdp11
+#include <sys/dir.h>            /* 2.11BSD names it struct direct */
+#define dirent direct
+#else
+#include <dirent.h>
+#endif
+
+#include "crc32.h"
+#include "gz.h"
 
 /* GZIP header constants */
 #define GZIP_MAGIC1     0x1f
 #define GZIP_MAGIC2     0x8b
 #define GZIP_DEFLATE    8
 
-/* Compression parameters - tuned for PDP-11 */
+/*
+ * Memory profile.  The PDP-11 keeps the small profile the compressor
+ * was tuned for; other hosts get the full 32KB DEFLATE window.  Define
+ * SMALLMEM to build the small profile anywhere.
+ */
+#if defined(pdp11) && !defined(SMALLMEM)
+#define SMALLMEM
+#endif
+
+#ifdef SMALLMEM
 #define WSIZE           4096U   /* Window size - 4KB */
 #define HASH_BITS       11      /* Hash table size = 2048 entries */
+#define LIT_BUFSIZE     4096    /* Literals and matches buffered per block */
+#define OUTBUFSIZ       1024    /* Output buffer size */
+#define STORED_PROBE    1024    /* Input sampled for incompressibility */
+#define PROBE_HASH      256     /* Strings remembered within one probe */
+typedef unsigned short Pos;     /* Window position in hash chains */
+#else
+#define WSIZE           32768U  /* Window size - 32KB, the DEFLATE maximum */
+#define HASH_BITS       15      /* Hash table size = 32768 entries */
+#define LIT_BUFSIZE     16384   /* Literals and matches buffered per block */
+#define OUTBUFSIZ       16384   /* Output buffer size */
+#define STORED_PROBE    4096    /* Input sampled for incompressibility */
+#define PROBE_HASH      1024    /* Strings remembered within one probe */
+typedef unsigned int Pos;       /* Window position in hash chains */
+#endif
+
+/* Compression parameters */
 #define HASH_SIZE       (1U << HASH_BITS)
 #define HASH_MASK       (HASH_SIZE - 1)
+#define HASH_SHIFT      ((HASH_BITS + MIN_MATCH - 1) / MIN_MATCH)
 #define MIN_MATCH       3       /* Minimum match length */
 #define MAX_MATCH       258     /* Maximum match length */
 #define MIN_LOOKAHEAD   (MAX_MATCH + MIN_MATCH + 1)
 
-/* Compression state */
-static unsigned char *window = NULL;    /* Sliding window buffer */
-static unsigned short *hash_head = NULL; /* Hash table head pointers */
-static unsigned short *prev = NULL;     /* Link to older string with same hash */
-static unsigned int wpos = 0;           /* Current position in window */
-static unsigned int lookahead = 0;      /* Bytes available at wpos */
-static unsigned int match_start = 0;    /* Start of current match */
-static unsigned int match_length = 0;   /* Length of current match */
+/* Slide once wpos gets this far into the upper half of the window */
+#define MAX_DIST        (WSIZE - MIN_LOOKAHEAD)
 
-/* Input/output */
-static FILE *infile = NULL;
-static FILE *outfile = NULL;
+/* Input per worker in parallel mode */
+#define CHUNK_SIZE      131072L
+
+/* Most workers in parallel mode */
+#define MAX_WORKERS     64
+
+/* End of a hash chain; position 0 is never matched */
+#define NIL             0
+
+/* Bits held by the bit buffer: 64 on LP64 hosts, 32 on the PDP-11 */
+#define BITBUF_BITS     ((int)(sizeof(unsigned long) * 8))
+
+/*
+ * Little-endian hosts with a 64-bit long can store the full bit buffer
+ * with a single unaligned word store, and compare match candidates a
+ * word at a time, finding the first difference from the trailing zeros
+ * of the XOR.
+ */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__SIZEOF_LONG__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && __SIZEOF_LONG__ == 8
+#define FAST_FLUSH
+#define FAST_MATCH
+#endif
+#endif
+
+/*
+ * Word compares run up to a word past MAX_MATCH without checking the
+ * lookahead, so the window has that much room after it
+ */
+#ifdef FAST_MATCH
+#define WINDOW_SLACK    (MAX_MATCH + sizeof(unsigned long))
+#else
+#define WINDOW_SLACK    0
+#endif
 
-/* Bit output buffer */
-static unsigned long outbuf = 0;
-static int outbits = 0;
+/*
+ * Hosts with mmap() compress regular files straight from a mapping of
+ * the input, sliding the window along it instead of copying.
+ */
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0
+#include <sys/mman.h>
+#if defined(MAP_ANONYMOUS) && defined(MAP_FIXED)
+#define USE_MMAP
+#endif
+#endif
+
+/* Huffman coding parameters */
+#define LITERALS        256     /* Literal byte codes */
+#define END_BLOCK       256     /* End of block code */
+#define LENGTH_CODES    29      /* Match length codes */
+#define L_CODES         (LITERALS + 1 + LENGTH_CODES)
+#define D_CODES         30      /* Distance codes */
+#define BL_CODES        19      /* Code length codes */
+#define MAX_BITS        15      /* Longest literal/length or distance code */
+#define MAX_BL_BITS     7       /* Longest code length code */
+
+/* Length-3 matches further back than this cost more than 3 literals */
+#define TOO_FAR         4096
+
+/*
+ * Near-optimal parsing.  Input goes in chunks of at most LIT_BUFSIZE
+ * bytes, recording up to OPT_CANDS matches per position; the parse is
+ * redone OPT_PASSES times, each with the costs of the codes the last
+ * one would get.  A block takes chunks until it has less than
+ * LIT_BUFSIZE / 4 symbols of room left.
+ */
+#define OPTIMAL_LEVEL   10
+#define OPT_CANDS       8
+#define OPT_POOL        (LIT_BUFSIZE * 4)
+#define OPT_PASSES      4
+#define OPT_UNUSED      13      /* Bits for a symbol the last parse left out */
+
+/*
+ * Compression levels.  Level 0 keeps one position per hash and no
+ * chains.  Levels 1-3 take the first match found and only hash the
+ * strings inside matches up to max_lazy bytes long; levels 4-9 defer a
+ * match by one byte in case the next one starts a longer match.  Level
+ * 10 chooses among all the matches found by the cost of the result.
+ */
+static struct config {
+    unsigned short good_length; /* Search a quarter as far past this length */
+    unsigned short max_lazy;    /* Lazy: skip lazy search past this length;
+                                 * greedy: longest match to hash fully */
+    unsigned short nice_length; /* Stop searching at this length */
+    unsigned short max_chain;   /* Hash chain entries to search */
+    int lazy;                   /* Use lazy evaluation */
+} config_table[OPTIMAL_LEVEL + 1] = {
+    /* 0 */ { 0, 0, 0, 0, 0 },             /* single probe */
+    /* 1 */ { 4, 4, 8, 4, 0 },
+    /* 2 */ { 4, 5, 16, 8, 0 },
+    /* 3 */ { 4, 6, 32, 32, 0 },
+    /* 4 */ { 4, 4, 16, 16, 1 },
+    /* 5 */ { 8, 16, 32, 32, 1 },
+    /* 6 */ { 8, 16, 128, 128, 1 },
+    /* 7 */ { 8, 32, 128, 256, 1 },
+    /* 8 */ { 32, 128, 258, 1024, 1 },
+    /* 9 */ { 32, 258, 258, 4096, 1 },
+    /* 10 */ { 32, 258, 258, 4096, 0 }     /* near-optimal parse */
+};
+
+#define DEFAULT_LEVEL   6
+
+/* Huffman code for one alphabet */
+struct tree {
+    unsigned short *freq;   /* Symbol counts for the current block */
+    unsigned char *len;     /* Code lengths */
+    unsigned short *code;   /* Codes, bit-reversed ready for put_bits() */
+    int elems;              /* Number of symbols */
+    int max_bits;           /* Longest code allowed */
+};
+
+/*
+ * Compression state.  Everything one stream needs lives in its context,
+ * so each caller can own one and reuse it for stream after stream.
+ */
+struct gz_deflate {
+    unsigned char *window;      /* Sliding window buffer */
+    Pos *hash_head;             /* Hash table head pointers */
+    Pos *prev;                  /* Link to older string with same hash */
+    unsigned int wpos;          /* Current position in window */
+    unsigned int lookahead;     /* Bytes available at wpos */
+    unsigned int match_start;   /* Start of current match */
+    unsigned int match_length;  /* Length of current match */
+    long block_start;           /* Window offset where block began */
+    long next_probe;            /* Window offset of the next sample */
+    unsigned int prev_length;   /* Match length found at the last byte */
+    
+    /* Search parameters for the compression level */
+    int level;
+    unsigned int good_match;
+    unsigned int max_lazy_match;
+    unsigned int nice_match;
+    unsigned int max_chain_length;
+    
+    /* Input/output callbacks */
+    gz_read_func read;
+    void *read_arg;
+    gz_write_func write;
+    void *write_arg;
+    int held;                   /* Byte read ahead by more_input(), or -1 */
+    int failed;                 /* Set once reading or writing fails */
+    
+    /* Bit output buffer, emptied a word at a time into outbuf */
+    unsigned long bitbuf;
+    int bitcount;
+    
+    /* Output buffer */
+    unsigned char *outbuf;
+    unsigned int outcnt;
+    unsigned long bytes_out;
+    
+    /* CRC32 value */
+    unsigned long crc;
+    unsigned long input_len;
+    
+    /* Input bytes still to read, or -1 to read to end of input */
+    long in_left;
+    
+    /* Input per gzip member, or 0 to write a single member */
+    long member_size;
+    char *header_name;
+    unsigned long total_in;
+    
+    /* Called every so often with total_in, if set */
+    void (*progress)(unsigned long done);
+    unsigned int progress_count;
+    
+#ifdef USE_MMAP
+    /* Mapped input: the window points into it while the mapping is in use */
+    unsigned char *map_base;
+    unsigned char *map_next;    /* First byte not yet read */
+    unsigned char *map_end;
+    size_t map_len;
+    unsigned char *window_buf;
+#endif
+    
+    /* Dynamic codes for the current block */
+    unsigned short lit_freq[L_CODES + 2];
+    unsigned char lit_len[L_CODES + 2];
+    unsigned short lit_code[L_CODES + 2];
+    unsigned short dist_freq[D_CODES];
+    unsigned char dist_len[D_CODES];
+    unsigned short dist_codes[D_CODES];
+    unsigned short bl_freq[BL_CODES];
+    unsigned char bl_len[BL_CODES];
+    unsigned short bl_codes[BL_CODES];
+    struct tree ltree, dtree, bltree;
+    
+    /* Symbols buffered for the current block */
+    unsigned char *l_buf;       /* Literal, or match length - 3 */
+    unsigned short *d_buf;      /* Match distance, 0 for a literal */
+    unsigned int last_lit;      /* Symbols in the buffers */
+    
+    /* Run-length coded code lengths of a dynamic block header */
+    unsigned char rle_sym[L_CODES + D_CODES];
+    unsigned char rle_extra[L_CODES + D_CODES];
+    int rle_count;
+    
+    /* Near-optimal parsing: the bytes of a chunk, the matches found at
+     * each position, and the cheapest way found to the chunk's end */
+    unsigned char *opt_lit;
+    unsigned int *opt_first;    /* First match of each position, and end */
+    unsigned short *opt_mlen;   /* Matches, longest last at a position */
+    unsigned short *opt_mdist;
+    unsigned long *opt_cost;    /* Bits from a position to the end */
+    unsigned short *opt_len;    /* Length taken at a position, 1 for a literal */
+    unsigned short *opt_dist;
+    unsigned short lit_cost[LITERALS];
+    unsigned short len_cost[MAX_MATCH + 1];
+    unsigned short dist_cost[D_CODES];
+    unsigned short opt_lit_freq[L_CODES + 2];   /* Block counts before the chunk */
+    unsigned short opt_dist_freq[D_CODES];
+    
+    /* Scratch space for build_tree() */
+    short heap_leaf[L_CODES + 2];
+    short heap_parent[2 * (L_CODES + 2)];
+    short heap_depth[2 * (L_CODES + 2)];
+    unsigned long heap_weight[L_CODES + 2];
+};
 
-/* CRC32 table and value */
-static unsigned long crc_table[256];
-static unsigned long crc = 0xffffffffL;
-static unsigned long input_len = 0;
+/*
+ * Hand output to the write callback, remembering any failure
+ */
+static void write_out(struct gz_deflate *s, unsigned char *buf, unsigned int n)
+{
+    if (!s->failed && s->write(s->write_arg, buf, n) != 0)
+        s->failed = 1;
+    s->bytes_out += n;
+}
 
 /*
- * Initialize CRC32 table
+ * Write the output buffer
  */
-static void make_crc_table(void)
+static void flush_outbuf(struct gz_deflate *s)
 {
-    unsigned long c;
-    int n, k;
+    if (s->outcnt == 0)
+        return;
     
-    for (n = 0; n < 256; n++) {
-        c = (unsigned long)n;
-        for (k = 0; k < 8; k++) {
-            if (c & 1)
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
-        }
-        crc_table[n] = c;
-    }
+    write_out(s, s->outbuf, s->outcnt);
+    s->outcnt = 0;
 }
 
 /*
- * Update CRC32 with new byte
+ * Write a byte to the output buffer
  */
-static void update_crc(unsigned char c)
+static void put_byte(struct gz_deflate *s, int c)
 {
-    crc = crc_table[(crc ^ c) & 0xff] ^ (crc >> 8);
+    s->outbuf[s->outcnt++] = (unsigned char)c;
+    if (s->outcnt >= OUTBUFSIZ)
+        flush_outbuf(s);
 }
 
 /*
- * Write bits to output
+ * Write bits to output.  Once the bit buffer fills, all of it goes to
+ * the output buffer at once and the bits that did not fit start the
+ * next word.
  */
-static void put_bits(int bits, int length)
+static void put_bits(struct gz_deflate *s, unsigned int bits, int length)
 {
-    outbuf |= ((unsigned long)bits << outbits);
-    outbits += length;
+    unsigned long w;
+#ifndef FAST_FLUSH
+    int i;
+#endif
     
-    while (outbits >= 8) {
-        putc((int)(outbuf & 0xff), outfile);
-        outbuf >>= 8;
-        outbits -= 8;
+    if (s->bitcount + length < BITBUF_BITS) {
+        s->bitbuf |= (unsigned long)bits << s->bitcount;
+        s->bitcount += length;
+        return;
     }
+    
+    w = s->bitbuf | ((unsigned long)bits << s->bitcount);
+    /* Flush early enough that the buffer is never left full, since
+     * put_byte() stores before it checks */
+    if (s->outcnt >= OUTBUFSIZ - sizeof(unsigned long))
+        flush_outbuf(s);
+#ifdef FAST_FLUSH
+    memcpy(s->outbuf + s->outcnt, &w, sizeof(unsigned long));
+#else
+    for (i = 0; i < BITBUF_BITS; i += 8)
+        s->outbuf[s->outcnt + (i >> 3)] = (unsigned char)(w >> i);
+#endif
+    s->outcnt += sizeof(unsigned long);
+    
+    s->bitbuf = (unsigned long)bits >> (BITBUF_BITS - s->bitcount);
+    s->bitcount += length - BITBUF_BITS;
 }
 
 /*
@@ -103,502 +368,2280 @@ static unsigned int reverse_bits(unsigned int value, int bits)
 }
 
 /*
- * Flush remaining bits
+ * Flush remaining bits, padding to a byte boundary
  */
-static void flush_bits(void)
+static void flush_bits(struct gz_deflate *s)
 {
-    if (outbits > 0) {
-        putc((int)(outbuf & 0xff), outfile);
+    while (s->bitcount > 0) {
+        put_byte(s, (int)(s->bitbuf & 0xff));
+        s->bitbuf >>= 8;
+        s->bitcount -= 8;
     }
-    outbuf = 0;
-    outbits = 0;
+    s->bitbuf = 0;
+    s->bitcount = 0;
 }
 
 /*
  * Write gzip header
  */
-static void write_header(char *filename)
+static void write_header(struct gz_deflate *s, char *filename)
 {
     time_t mtime = time(NULL);
     
     /* Magic number */
-    putc(GZIP_MAGIC1, outfile);
-    putc(GZIP_MAGIC2, outfile);
+    put_byte(s, GZIP_MAGIC1);
+    put_byte(s, GZIP_MAGIC2);
     
     /* Compression method */
-    putc(GZIP_DEFLATE, outfile);
+    put_byte(s, GZIP_DEFLATE);
     
-    /* Flags - include original filename */
-    putc(0x08, outfile);
+    /* Flags - include original filename, if there is one */
+    put_byte(s, filename != NULL ? 0x08 : 0);
     
     /* Modification time */
-    putc((int)(mtime & 0xff), outfile);
-    putc((int)((mtime >> 8) & 0xff), outfile);
-    putc((int)((mtime >> 16) & 0xff), outfile);
-    putc((int)((mtime >> 24) & 0xff), outfile);
+    put_byte(s, (int)(mtime & 0xff));
+    put_byte(s, (int)((mtime >> 8) & 0xff));
+    put_byte(s, (int)((mtime >> 16) & 0xff));
+    put_byte(s, (int)((mtime >> 24) & 0xff));
     
     /* Extra flags (2 = max compression, 4 = fastest) */
-    putc(4, outfile);
+    put_byte(s, s->level >= 9 ? 2 : (s->level <= 1 ? 4 : 0));
     
     /* OS (3 = Unix) */
-    putc(3, outfile);
+    put_byte(s, 3);
     
     /* Original filename */
-    while (*filename) {
-        putc(*filename++, outfile);
+    if (filename != NULL) {
+        while (*filename) {
+            put_byte(s, *filename++);
+        }
+        put_byte(s, 0);
     }
-    putc(0, outfile);
 }
 
 /*
- * Write gzip trailer
+ * Write gzip trailer after the last block, which must already be
+ * flushed to a byte boundary
  */
-static void write_trailer(void)
+static void write_trailer(struct gz_deflate *s)
 {
-    unsigned long c = crc ^ 0xffffffffL;
+    unsigned long c = s->crc ^ 0xffffffffL;
     int i;
     
-    /* CRC32 - write byte by byte using put_bits */
+    /* CRC32 */
     for (i = 0; i < 4; i++) {
-        put_bits((int)((c >> (i * 8)) & 0xff), 8);
+        put_byte(s, (int)((c >> (i * 8)) & 0xff));
     }
     
-    /* Uncompressed size - write byte by byte using put_bits */
+    /* Uncompressed size */
     for (i = 0; i < 4; i++) {
-        put_bits((int)((input_len >> (i * 8)) & 0xff), 8);
+        put_byte(s, (int)((s->input_len >> (i * 8)) & 0xff));
     }
+    
+    flush_outbuf(s);
 }
 
 /*
- * Compute hash value for 3-byte sequence
+ * Compute hash value for 3-byte sequence, each byte shifted so that
+ * all three reach the top bits of the hash
  */
 static unsigned int hash_func(unsigned char *p)
 {
-    return ((((unsigned int)p[0] << 10) ^ 
-             ((unsigned int)p[1] << 5) ^ 
+    return ((((unsigned int)p[0] << (2 * HASH_SHIFT)) ^ 
+             ((unsigned int)p[1] << HASH_SHIFT) ^ 
              (unsigned int)p[2]) & HASH_MASK);
 }
 
+/*
+ * Hash of the 4 bytes at p, for the single-probe table of level 0
+ */
+static unsigned int hash4(unsigned char *p)
+{
+    unsigned long v;
+    
+    v = (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+        ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+    return (unsigned int)(((v * 2654435761UL) & 0xffffffffL) >> (32 - HASH_BITS));
+}
+
 /*
  * Insert string at current position into hash table
  */
-static void insert_string(void)
+static void insert_string(struct gz_deflate *s)
 {
     unsigned int hash;
     
-    if (lookahead < MIN_MATCH)
+    if (s->lookahead < MIN_MATCH)
         return;
     
-    hash = hash_func(&window[wpos]);
-    prev[wpos & (WSIZE - 1)] = hash_head[hash];
-    hash_head[hash] = wpos;
+    hash = hash_func(&s->window[s->wpos]);
+    s->prev[s->wpos & (WSIZE - 1)] = s->hash_head[hash];
+    s->hash_head[hash] = s->wpos;
+}
+
+/*
+ * Length of the common prefix of two strings in the window, up to
+ * max bytes
+ */
+static unsigned int match_len(unsigned char *scan, unsigned char *match,
+                              unsigned int max)
+{
+    unsigned int len = 0;
+#ifdef FAST_MATCH
+    unsigned long a, b;
+    
+    while (len < max) {
+        memcpy(&a, scan + len, sizeof(unsigned long));
+        memcpy(&b, match + len, sizeof(unsigned long));
+        if (a != b) {
+            len += __builtin_ctzl(a ^ b) >> 3;
+            break;
+        }
+        len += sizeof(unsigned long);
+    }
+    return (len < max) ? len : max;
+#else
+    while (len < max && scan[len] == match[len])
+        len++;
+    return len;
+#endif
 }
 
 /*
- * Find longest match starting at current position
+ * Find longest match starting at current position.  Only matches
+ * longer than prev_length are of interest.
  */
-static int find_match(void)
+static int find_match(struct gz_deflate *s)
 {
-    unsigned int chain_length = 128;  /* Max hash chain to search */
+    unsigned int chain_length = s->max_chain_length;
     unsigned int cur_match;
     unsigned int hash;
-    int len;
-    int best_len = 0;
-    unsigned char *scan, *match;
-    int limit = (wpos > WSIZE) ? (wpos - WSIZE) : 0;
+    unsigned int len;
+    unsigned int best_len = s->prev_length;
+    unsigned int nice = s->nice_match;
+    unsigned int max = (s->lookahead < MAX_MATCH) ? s->lookahead : MAX_MATCH;
+    unsigned int limit = (s->wpos > WSIZE) ? (s->wpos - WSIZE) : NIL;
     
-    if (lookahead < MIN_MATCH)
+    s->match_length = best_len;
+    if (s->lookahead < MIN_MATCH || best_len >= s->lookahead)
         return 0;
     
-    hash = hash_func(&window[wpos]);
-    cur_match = hash_head[hash];
+    /* Do not waste too much time if we already have a good match */
+    if (s->prev_length >= s->good_match)
+        chain_length >>= 2;
+    if (nice > s->lookahead)
+        nice = s->lookahead;
+    
+    hash = hash_func(&s->window[s->wpos]);
+    cur_match = s->hash_head[hash];
     
     /* Search hash chain */
-    while (cur_match >= (unsigned int)limit && chain_length-- > 0) {
+    while (cur_match > limit && chain_length-- > 0) {
         /* Skip if matching current position or if match is too recent */
-        if (cur_match >= wpos) {
-            cur_match = prev[cur_match & (WSIZE - 1)];
+        if (cur_match >= s->wpos) {
+            cur_match = s->prev[cur_match & (WSIZE - 1)];
             continue;
         }
         
         /* Quick check on first and last bytes */
-        if (window[cur_match + best_len] == window[wpos + best_len] &&
-            window[cur_match] == window[wpos]) {
+        if (s->window[cur_match + best_len] == s->window[s->wpos + best_len] &&
+            s->window[cur_match] == s->window[s->wpos]) {
             
             /* Check full match */
-            scan = &window[wpos];
-            match = &window[cur_match];
-            len = 0;
-            
-            while (len < MAX_MATCH && len < lookahead && 
-                   scan[len] == match[len]) {
-                len++;
-            }
+            len = match_len(&s->window[s->wpos], &s->window[cur_match], max);
             
             if (len > best_len) {
                 best_len = len;
-                match_start = cur_match;
+                s->match_start = cur_match;
                 
-                if (len >= MAX_MATCH)
+                if (len >= nice)
                     break;
             }
         }
         
-        cur_match = prev[cur_match & (WSIZE - 1)];
+        cur_match = s->prev[cur_match & (WSIZE - 1)];
+    }
+    
+    s->match_length = best_len;
+    return best_len >= MIN_MATCH && best_len > s->prev_length;
+}
+
+/*
+ * Record each match at the current position that is longer than every
+ * nearer one, giving at most OPT_CANDS of the longest.  Returns how
+ * many there are.
+ */
+static int find_matches(struct gz_deflate *s, unsigned short *mlen,
+                        unsigned short *mdist)
+{
+    unsigned int chain_length = s->max_chain_length;
+    unsigned int cur_match;
+    unsigned int len;
+    unsigned int best_len = MIN_MATCH - 1;
+    unsigned int max = (s->lookahead < MAX_MATCH) ? s->lookahead : MAX_MATCH;
+    unsigned int limit = (s->wpos > WSIZE) ? (s->wpos - WSIZE) : NIL;
+    int n = 0;
+    
+    if (max < MIN_MATCH)
+        return 0;
+    
+    cur_match = s->hash_head[hash_func(&s->window[s->wpos])];
+    while (cur_match > limit && chain_length-- > 0) {
+        if (cur_match < s->wpos &&
+            s->window[cur_match + best_len] == s->window[s->wpos + best_len] &&
+            s->window[cur_match] == s->window[s->wpos]) {
+            len = match_len(&s->window[s->wpos], &s->window[cur_match], max);
+            if (len > best_len) {
+                best_len = len;
+                if (n == OPT_CANDS)
+                    n--;
+                mlen[n] = len;
+                mdist[n++] = s->wpos - cur_match;
+                if (len >= s->nice_match || len == max)
+                    break;
+            }
+        }
+        cur_match = s->prev[cur_match & (WSIZE - 1)];
     }
+    return n;
+}
+
+/*
+ * Rebase the hash chains after the window slides down by WSIZE.
+ * Entries that fall off the front become NIL.  The loops are kept
+ * branch-free so the compiler can vectorize them.
+ */
+static void slide_hash(struct gz_deflate *s)
+{
+    unsigned int n;
+    Pos m;
     
-    match_length = best_len;
-    return best_len >= MIN_MATCH;
+    for (n = 0; n < HASH_SIZE; n++) {
+        m = s->hash_head[n];
+        s->hash_head[n] = (Pos)(m >= WSIZE ? m - WSIZE : NIL);
+    }
+    for (n = 0; n < WSIZE; n++) {
+        m = s->prev[n];
+        s->prev[n] = (Pos)(m >= WSIZE ? m - WSIZE : NIL);
+    }
 }
 
 /*
- * Fill the lookahead buffer
+ * Fill the lookahead buffer.  Called only when lookahead has fallen
+ * below MIN_LOOKAHEAD; reads go straight into the window in blocks of
+ * up to WSIZE bytes.
  */
-static void fill_window(void)
+static void fill_window(struct gz_deflate *s)
 {
     int n, more;
     
     do {
-        more = (WSIZE * 2) - lookahead - wpos;
+        more = (int)((WSIZE * 2) - s->lookahead - s->wpos);
         
-        if (more == 0 && wpos == 0 && lookahead == 0) {
-            more = WSIZE * 2;
-        }
-        else if (more <= 0 && wpos >= WSIZE) {
-            /* Slide window - move second half to first half */
-            int i;
-            memcpy(window, window + WSIZE, WSIZE);
+        if (s->wpos >= WSIZE + MAX_DIST) {
+            /* Slide window - move second half to first half only when
+             * the lookahead runs low, so at least MAX_DIST bytes of
+             * history stay behind wpos.  A mapped window just moves. */
+#ifdef USE_MMAP
+            if (s->map_base != NULL)
+                s->window += WSIZE;
+            else
+#endif
+            memcpy(s->window, s->window + WSIZE, WSIZE);
             
             /* Adjust positions */
-            if (match_start >= WSIZE)
-                match_start -= WSIZE;
+            if (s->match_start >= WSIZE)
+                s->match_start -= WSIZE;
             else
-                match_start = 0;
+                s->match_start = 0;
             
-            wpos -= WSIZE;
+            s->wpos -= WSIZE;
+            s->block_start -= WSIZE;
+            s->next_probe -= WSIZE;
             
-            /* Clear hash table since all positions have shifted */
-            for (i = 0; i < HASH_SIZE; i++)
-                hash_head[i] = 0;
+            slide_hash(s);
             
-            /* Recalculate available space */
-            more = (WSIZE * 2) - lookahead - wpos;
+            more += WSIZE;
         }
-        else if (more <= 0) {
-            /* Can't read more - window is full */
+        
+        if (s->in_left >= 0 && more > s->in_left)
+            more = (int)s->in_left;
+        if (more == 0)
             break;
-        }
         
-        if (more > 0) {
-            n = fread(window + wpos + lookahead, 1, more, infile);
-            if (n > 0) {
-                lookahead += n;
-            }
-            else {
-                break;
-            }
+#ifdef USE_MMAP
+        if (s->map_base != NULL) {
+            n = (s->map_end - s->map_next < more) ? (int)(s->map_end - s->map_next) : more;
+            s->map_next += n;
+        }
+        else
+#endif
+        if (s->held >= 0) {
+            /* Byte read ahead by more_input() */
+            s->window[s->wpos + s->lookahead] = (unsigned char)s->held;
+            s->held = -1;
+            n = 1;
         }
-    } while (lookahead < MIN_LOOKAHEAD && !feof(infile));
+        else
+            n = s->read(s->read_arg, s->window + s->wpos + s->lookahead, more);
+        if (n < 0)
+            s->failed = 1;
+        if (n <= 0)
+            break;
+        
+        /* Checksum input as it arrives */
+        s->crc = update_crc(s->crc, s->window + s->wpos + s->lookahead, n);
+        s->input_len += n;
+        s->total_in += n;
+        s->lookahead += n;
+        if (s->in_left >= 0)
+            s->in_left -= n;
+    } while (s->lookahead < MIN_LOOKAHEAD);
 }
 
 /*
- * Fixed Huffman code tables (RFC 1951)
- * Literals 0-143:   00110000 - 10111111  (8 bits, values 0x30-0xBF)
- * Literals 144-255: 110010000 - 111111111 (9 bits, values 0x190-0x1FF)
- * EOB 256:          0000000                (7 bits, value 0x0)
- * Lengths 257-279:  0000001 - 0010111     (7 bits, values 0x1-0x17)
- * Lengths 280-287:  11000000 - 11000111   (8 bits, values 0xC0-0xC7)
+ * Huffman coding
+ *
+ * Literals and matches are buffered for a block, then the block is
+ * sent as whichever of a stored, fixed Huffman or dynamic Huffman
+ * block (RFC 1951) comes out smallest.
  */
 
-static void send_literal(int c)
+/* Extra bits for each length code */
+static const unsigned char extra_lbits[LENGTH_CODES] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+/* Extra bits for each distance code */
+static const unsigned char extra_dbits[D_CODES] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Extra bits for each code length code */
+static const unsigned char extra_blbits[BL_CODES] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7
+};
+
+/* Order in which code length code lengths are sent */
+static const unsigned char bl_order[BL_CODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/*
+ * The tables that follow derive from the extra bits above: each code
+ * covers 1 << extra lengths or distances from its base.  The fixed codes
+ * are the canonical codes of RFC 1951 3.2.6, bit-reversed as gen_codes()
+ * would make them.  All of them are written out in full, so that every
+ * context in every thread shares them without setting anything up.
+ */
+
+/* Code for each match length minus MIN_MATCH; 258 has its own code */
+static const unsigned char length_code[MAX_MATCH - MIN_MATCH + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+    12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15,
+    16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17,
+    18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19, 19,
+    20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+    23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+    24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 28
+};
+
+/* Code for each distance - 1 below 256, then for (distance - 1) >> 7 */
+static const unsigned char dist_code[512] = {
+    0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7,
+    8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9,
+    10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+    12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+    13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+    13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    0, 0, 16, 17, 18, 18, 19, 19, 20, 20, 20, 20, 21, 21, 21, 21,
+    22, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 23, 23, 23,
+    24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29
+};
+
+/* First length (minus MIN_MATCH) and distance (minus 1) of each code */
+static const unsigned short base_length[LENGTH_CODES] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 10,
+    12, 14, 16, 20, 24, 28, 32, 40, 48, 56,
+    64, 80, 96, 112, 128, 160, 192, 224, 255
+};
+static const unsigned short base_dist[D_CODES] = {
+    0, 1, 2, 3, 4, 6, 8, 12, 16, 24,
+    32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+    1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576
+};
+
+/* Distance code for dist - 1 */
+#define d_code(dist) \
+    ((dist) < 256 ? dist_code[dist] : dist_code[256 + ((dist) >> 7)])
+
+/* Fixed codes: 8, 9, 7 and 8 bits for the literal/length ranges, 5 for
+ * every distance */
+static const unsigned char fixed_lit_len[L_CODES + 2] = {
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 8
+};
+static const unsigned short fixed_lit_code[L_CODES + 2] = {
+    12, 140, 76, 204, 44, 172, 108, 236, 28, 156, 92, 220,
+    60, 188, 124, 252, 2, 130, 66, 194, 34, 162, 98, 226,
+    18, 146, 82, 210, 50, 178, 114, 242, 10, 138, 74, 202,
+    42, 170, 106, 234, 26, 154, 90, 218, 58, 186, 122, 250,
+    6, 134, 70, 198, 38, 166, 102, 230, 22, 150, 86, 214,
+    54, 182, 118, 246, 14, 142, 78, 206, 46, 174, 110, 238,
+    30, 158, 94, 222, 62, 190, 126, 254, 1, 129, 65, 193,
+    33, 161, 97, 225, 17, 145, 81, 209, 49, 177, 113, 241,
+    9, 137, 73, 201, 41, 169, 105, 233, 25, 153, 89, 217,
+    57, 185, 121, 249, 5, 133, 69, 197, 37, 165, 101, 229,
+    21, 149, 85, 213, 53, 181, 117, 245, 13, 141, 77, 205,
+    45, 173, 109, 237, 29, 157, 93, 221, 61, 189, 125, 253,
+    19, 275, 147, 403, 83, 339, 211, 467, 51, 307, 179, 435,
+    115, 371, 243, 499, 11, 267, 139, 395, 75, 331, 203, 459,
+    43, 299, 171, 427, 107, 363, 235, 491, 27, 283, 155, 411,
+    91, 347, 219, 475, 59, 315, 187, 443, 123, 379, 251, 507,
+    7, 263, 135, 391, 71, 327, 199, 455, 39, 295, 167, 423,
+    103, 359, 231, 487, 23, 279, 151, 407, 87, 343, 215, 471,
+    55, 311, 183, 439, 119, 375, 247, 503, 15, 271, 143, 399,
+    79, 335, 207, 463, 47, 303, 175, 431, 111, 367, 239, 495,
+    31, 287, 159, 415, 95, 351, 223, 479, 63, 319, 191, 447,
+    127, 383, 255, 511, 0, 64, 32, 96, 16, 80, 48, 112,
+    8, 72, 40, 104, 24, 88, 56, 120, 4, 68, 36, 100,
+    20, 84, 52, 116, 3, 131, 67, 195, 35, 163, 99, 227
+};
+static const unsigned char fixed_dist_len[D_CODES] = {
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5
+};
+static const unsigned short fixed_dist_code[D_CODES] = {
+    0, 16, 8, 24, 4, 20, 12, 28, 2, 18, 10, 26,
+    6, 22, 14, 30, 1, 17, 9, 25, 5, 21, 13, 29,
+    3, 19, 11, 27, 7, 23
+};
+
+/*
+ * Assign canonical codes to a tree from its code lengths
+ */
+static void gen_codes(struct tree *t)
 {
-    if (c <= 143) {
-        /* Codes 0-143: 00110000 through 10111111 (8 bits) */
-        /* These need to be bit-reversed: 00001100 through 11111101 */
-        put_bits(reverse_bits(0x30 + c, 8), 8);
-    } else {
-        /* Codes 144-255: 110010000 through 111111111 (9 bits) */
-        /* These need to be bit-reversed */
-        put_bits(reverse_bits(0x190 + (c - 144), 9), 9);
+    unsigned int next_code[MAX_BITS + 1];
+    unsigned int code;
+    short count[MAX_BITS + 1];
+    int bits, n;
+    
+    for (bits = 0; bits <= MAX_BITS; bits++)
+        count[bits] = 0;
+    for (n = 0; n < t->elems; n++)
+        count[t->len[n]]++;
+    count[0] = 0;
+    
+    code = 0;
+    for (bits = 1; bits <= MAX_BITS; bits++) {
+        code = (code + count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    
+    for (n = 0; n < t->elems; n++) {
+        if (t->len[n] != 0)
+            t->code[n] = reverse_bits(next_code[t->len[n]]++, t->len[n]);
     }
 }
 
-static void send_length(int length)
+/*
+ * Build a Huffman code for the symbol counts in t->freq, with no
+ * code longer than t->max_bits, and assign its codes.
+ */
+static void build_tree(struct gz_deflate *s, struct tree *t)
 {
-    int code, extra, base_length, i;
+    short count[MAX_BITS + 1];
+    unsigned long w, kraft, target;
+    int n, sym, i, k, li, ni, next, root, bits, max, overflow;
     
-    /* Simplified length encoding for fixed Huffman */
-    /* Lengths 3-10: codes 257-264 (0 extra) */
-    /* Lengths 11-18: codes 265-268 (1 extra) */
-    /* Lengths 19-34: codes 269-272 (2 extra) */
-    /* etc. */
+    max = t->max_bits;
     
-    static short base_lengths[] = {
-        3, 4, 5, 6, 7, 8, 9, 10,    /* codes 257-264 */
-        11, 13, 15, 17,              /* codes 265-268, 1 extra bit */
-        19, 23, 27, 31,              /* codes 269-272, 2 extra bits */
-        35, 43, 51, 59,              /* codes 273-276, 3 extra bits */
-        67, 83, 99, 115,             /* codes 277-280, 4 extra bits */
-        131, 163, 195, 227, 258      /* codes 281-285, 5 extra bits (except 258) */
-    };
-    static short extra_bits[] = {
-        0, 0, 0, 0, 0, 0, 0, 0,      /* codes 257-264 */
-        1, 1, 1, 1,                  /* codes 265-268 */
-        2, 2, 2, 2,                  /* codes 269-272 */
-        3, 3, 3, 3,                  /* codes 273-276 */
-        4, 4, 4, 4,                  /* codes 277-280 */
-        5, 5, 5, 5, 0                /* codes 281-285 */
-    };
+    /* Sort the symbols that occur by count, least frequent first */
+    n = 0;
+    for (sym = 0; sym < t->elems; sym++) {
+        t->len[sym] = 0;
+        if (t->freq[sym] == 0)
+            continue;
+        for (i = n++; i > 0 && t->freq[s->heap_leaf[i - 1]] > t->freq[sym]; i--)
+            s->heap_leaf[i] = s->heap_leaf[i - 1];
+        s->heap_leaf[i] = sym;
+    }
     
-    /* Find the code for this length */
-    code = 0;
-    for (i = 0; i < 29; i++) {
-        if (length < base_lengths[i + 1]) {
-            code = i;
-            break;
+    /* Give a code at least two symbols so every inflater accepts it */
+    if (n < 2) {
+        if (n == 1)
+            t->len[s->heap_leaf[0]] = 1;
+        for (sym = 0; n < 2; sym++) {
+            if (t->len[sym] == 0) {
+                t->len[sym] = 1;
+                n++;
+            }
+        }
+        gen_codes(t);
+        return;
+    }
+    
+    /*
+     * Combine the two lightest subtrees until one remains.  Leaves are
+     * numbered 0..n-1 in sorted order and internal nodes n..2n-2 in the
+     * order made, so both queues stay sorted by weight.
+     */
+    li = 0;
+    ni = n;
+    for (next = n; next < 2 * n - 1; next++) {
+        w = 0;
+        for (k = 0; k < 2; k++) {
+            if (li < n && (ni >= next ||
+                           t->freq[s->heap_leaf[li]] <= s->heap_weight[ni - n])) {
+                w += t->freq[s->heap_leaf[li]];
+                s->heap_parent[li++] = next;
+            }
+            else {
+                w += s->heap_weight[ni - n];
+                s->heap_parent[ni++] = next;
+            }
         }
+        s->heap_weight[next - n] = w;
     }
     
-    extra = extra_bits[code];
-    base_length = base_lengths[code];
+    /* Depth of every node, working down from the root */
+    root = 2 * n - 2;
+    s->heap_depth[root] = 0;
+    for (i = root - 1; i >= 0; i--)
+        s->heap_depth[i] = s->heap_depth[s->heap_parent[i]] + 1;
+    
+    /* Count leaves at each depth, clamping any that are too deep */
+    for (bits = 0; bits <= MAX_BITS; bits++)
+        count[bits] = 0;
+    overflow = 0;
+    for (i = 0; i < n; i++) {
+        if (s->heap_depth[i] > max) {
+            count[max]++;
+            overflow = 1;
+        }
+        else
+            count[s->heap_depth[i]]++;
+    }
     
-    /* Send length code (257 + code) */
-    if (code <= 22) {
-        /* Codes 257-279 are 7 bits: 0000001 through 0010111 */
-        put_bits(reverse_bits(code + 1, 7), 7);
-    } else {
-        /* Codes 280-287 are 8 bits: 11000000 through 11000111 */
-        put_bits(reverse_bits(0xC0 + (code - 23), 8), 8);
+    if (overflow) {
+        /* Clamping over-subscribed the code: lengthen the longest codes
+         * below the limit until the Kraft sum fits again */
+        target = 1L << max;
+        kraft = 0;
+        for (bits = 1; bits <= max; bits++)
+            kraft += (unsigned long)count[bits] << (max - bits);
+        while (kraft > target) {
+            for (bits = max - 1; count[bits] == 0; bits--)
+                ;
+            count[bits]--;
+            count[bits + 1]++;
+            kraft -= 1L << (max - bits - 1);
+        }
+        
+        /* Then shorten codes to take up any slack left over */
+        while (kraft < target) {
+            for (bits = max; count[bits] == 0 ||
+                             (1L << (max - bits)) > (long)(target - kraft); bits--)
+                ;
+            count[bits]--;
+            count[bits - 1]++;
+            kraft += 1L << (max - bits);
+        }
     }
     
-    /* Send extra bits - NOT reversed, just raw value */
-    if (extra > 0) {
-        put_bits(length - base_length, extra);
+    /* Hand out the lengths, longest to the least frequent symbols */
+    i = 0;
+    for (bits = max; bits > 0; bits--) {
+        for (k = count[bits]; k > 0; k--)
+            t->len[s->heap_leaf[i++]] = bits;
     }
+    
+    gen_codes(t);
 }
 
-static void send_distance(int dist)
+/*
+ * Start a new block
+ */
+static void init_block(struct gz_deflate *s)
 {
-    int code, extra, base_dist;
+    int n;
     
-    /* Base distances and extra bits for each distance code */
-    static unsigned int base_distances[] = {
-        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
-        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
-        8193, 12289, 16385, 24577
-    };
-    static unsigned char extra_bits[] = {
-        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
-        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
-    };
+    for (n = 0; n < L_CODES; n++)
+        s->lit_freq[n] = 0;
+    for (n = 0; n < D_CODES; n++)
+        s->dist_freq[n] = 0;
+    s->lit_freq[END_BLOCK] = 1;
+    s->last_lit = 0;
+}
+
+/*
+ * Buffer a literal (dist 0, lc the byte) or a match (lc the length
+ * minus MIN_MATCH).  Returns nonzero once the block buffer is full.
+ */
+static int tally(struct gz_deflate *s, unsigned int dist, unsigned int lc)
+{
+    s->l_buf[s->last_lit] = lc;
+    s->d_buf[s->last_lit++] = dist;
     
-    /* Find the distance code by comparing to base distances */
-    code = 0;
-    while (code < 29 && dist >= base_distances[code + 1]) {
-        code++;
+    if (dist == 0) {
+        s->lit_freq[lc]++;
     }
-    
-    extra = extra_bits[code];
-    base_dist = base_distances[code];
-    
-    /* Distance codes are 5 bits, bit-reversed */
-    put_bits(reverse_bits(code, 5), 5);
-    
-    /* Send extra bits - NOT reversed, just raw value */
-    if (extra > 0) {
-        put_bits(dist - base_dist, extra);
+    else {
+        s->lit_freq[length_code[lc] + LITERALS + 1]++;
+        s->dist_freq[d_code(dist - 1)]++;
     }
+    
+    return s->last_lit == LIT_BUFSIZE;
 }
 
 /*
- * Compress the data
+ * Bits needed to send the buffered symbols with the given code
+ * lengths, extra bits included
  */
-static int compress_data(void)
+static long block_bits(struct gz_deflate *s, const unsigned char *llen,
+                       const unsigned char *dlen)
 {
-    unsigned int i;
-    long file_size, current_pos;
-    
-    /* Get file size for progress reporting */
-    fseek(infile, 0L, 2);  /* SEEK_END */
-    file_size = ftell(infile);
-    fseek(infile, 0L, 0);  /* SEEK_SET */
-    
-    /* Initialize hash table */
-    for (i = 0; i < HASH_SIZE; i++)
-        hash_head[i] = 0;
-    
-    /* Start with empty window */
-    wpos = 0;
-    lookahead = 0;
+    long bits = 0;
+    int n;
     
-    /* Fill initial window */
-    fill_window();
+    for (n = 0; n < L_CODES; n++)
+        bits += (long)s->lit_freq[n] * llen[n];
+    for (n = 0; n < LENGTH_CODES; n++)
+        bits += (long)s->lit_freq[n + LITERALS + 1] * extra_lbits[n];
+    for (n = 0; n < D_CODES; n++)
+        bits += (long)s->dist_freq[n] * (dlen[n] + extra_dbits[n]);
+    return bits;
+}
+
+/*
+ * Run-length code the literal/length and distance code lengths with
+ * code length codes 16 (repeat previous 3-6 times), 17 (3-10 zeros)
+ * and 18 (11-138 zeros), counting how often each code is used.
+ */
+static void scan_lengths(struct gz_deflate *s, int lcodes, int dcodes)
+{
+    unsigned char lens[L_CODES + D_CODES];
+    int n, i, run, left, k, v;
     
-    if (lookahead == 0)
-        return 0;  /* Empty file */
+    memcpy(lens, s->lit_len, lcodes);
+    memcpy(lens + lcodes, s->dist_len, dcodes);
+    n = lcodes + dcodes;
     
-    /* Send block header: final block, fixed Huffman */
-    put_bits(1, 1);  /* BFINAL = 1 */
-    put_bits(1, 2);  /* BTYPE = 01 (fixed Huffman) */
+    for (i = 0; i < BL_CODES; i++)
+        s->bl_freq[i] = 0;
+    s->rle_count = 0;
     
-    /* Compress the data */
-    while (lookahead > 0) {
-        static unsigned int count = 0;
-        if (++count % 100 == 0) {
-            current_pos = ftell(infile);
-            if (file_size > 0) {
-                int percent = (int)((current_pos * 100L) / file_size);
-                fprintf(stderr, "\rCompressing: %d%% (%ld/%ld bytes)", 
-                        percent, current_pos, file_size);
-            }
-        }
+    for (i = 0; i < n; i += run) {
+        v = lens[i];
+        for (run = 1; i + run < n && lens[i + run] == v; run++)
+            ;
+        left = run;
         
-        /* Try to find a match */
-        if (find_match() && match_length >= MIN_MATCH) {
-            /* Send length/distance pair */
-            int distance = wpos - match_start;
-            
-            send_length(match_length);
-            send_distance(distance);
-            
-            /* Insert all strings in the match and update CRC */
-            for (i = 0; i < match_length; i++) {
-                update_crc(window[wpos]);
-                input_len++;
-                if (lookahead >= MIN_MATCH)
-                    insert_string();
-                wpos++;
-                lookahead--;
-                if (lookahead > 0 && i < match_length - 1)
-                    fill_window();
+        if (v == 0) {
+            while (left >= 11) {
+                k = (left > 138) ? 138 : left;
+                s->rle_sym[s->rle_count] = 18;
+                s->rle_extra[s->rle_count++] = k - 11;
+                left -= k;
+            }
+            if (left >= 3) {
+                s->rle_sym[s->rle_count] = 17;
+                s->rle_extra[s->rle_count++] = left - 3;
+                left = 0;
             }
         }
         else {
-            /* Send literal */
-            send_literal(window[wpos]);
-            update_crc(window[wpos]);
-            input_len++;
-            insert_string();
-            wpos++;
-            lookahead--;
-            fill_window();
+            s->rle_sym[s->rle_count] = v;
+            s->rle_extra[s->rle_count++] = 0;
+            left--;
+            while (left >= 3) {
+                k = (left > 6) ? 6 : left;
+                s->rle_sym[s->rle_count] = 16;
+                s->rle_extra[s->rle_count++] = k - 3;
+                left -= k;
+            }
+        }
+        
+        while (left-- > 0) {
+            s->rle_sym[s->rle_count] = v;
+            s->rle_extra[s->rle_count++] = 0;
         }
     }
     
-    /* Send end of block (code 256) */
-    put_bits(reverse_bits(0, 7), 7);  /* Code 256 is 0000000 (7 bits, reversed) */
-    
-    /* Pad to byte boundary */
-    if (outbits > 0) {
-        put_bits(0, 8 - outbits);
-    }
-    
-    /* Clear progress line */
-    fprintf(stderr, "\rCompressing: 100%% (%ld/%ld bytes)\n", file_size, file_size);
-    
-    return 0;
+    for (i = 0; i < s->rle_count; i++)
+        s->bl_freq[s->rle_sym[i]]++;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Send the header of a dynamic block: code counts, the code length
+ * code, then the run-length coded literal/length and distance lengths
+ */
+static void send_trees(struct gz_deflate *s, int lcodes, int dcodes, int blcodes)
 {
-    char *inname, *outname;
-    char *basename;
-    int len;
+    int i, sym;
     
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <file>\n", argv[0]);
-        return 1;
-    }
+    put_bits(s, lcodes - 257, 5);
+    put_bits(s, dcodes - 1, 5);
+    put_bits(s, blcodes - 4, 4);
+    for (i = 0; i < blcodes; i++)
+        put_bits(s, s->bl_len[bl_order[i]], 3);
     
-    inname = argv[1];
-    
-    /* Open input file */
-    infile = fopen(inname, "rb");
-    if (infile == NULL) {
-        perror(inname);
-        return 1;
+    for (i = 0; i < s->rle_count; i++) {
+        sym = s->rle_sym[i];
+        put_bits(s, s->bl_codes[sym], s->bl_len[sym]);
+        if (extra_blbits[sym])
+            put_bits(s, s->rle_extra[i], extra_blbits[sym]);
     }
+}
+
+/*
+ * Send the buffered symbols using the given codes and code lengths,
+ * then end-of-block
+ */
+static void compress_block(struct gz_deflate *s,
+                           const unsigned short *lcode, const unsigned char *llen,
+                           const unsigned short *dcode, const unsigned char *dlen)
+{
+    unsigned int i, lc, dist, code;
+    int extra;
     
-    /* Create output filename */
-    len = strlen(inname);
-    outname = malloc(len + 4);
-    if (outname == NULL) {
-        fprintf(stderr, "Out of memory\n");
-        fclose(infile);
-        return 1;
+    for (i = 0; i < s->last_lit; i++) {
+        lc = s->l_buf[i];
+        dist = s->d_buf[i];
+        
+        if (dist == 0) {
+            /* Literal byte */
+            put_bits(s, lcode[lc], llen[lc]);
+            continue;
+        }
+        
+        /* Length code and extra bits - NOT reversed, just raw value */
+        code = length_code[lc];
+        put_bits(s, lcode[code + LITERALS + 1], llen[code + LITERALS + 1]);
+        extra = extra_lbits[code];
+        if (extra > 0)
+            put_bits(s, lc - base_length[code], extra);
+        
+        /* Distance code and extra bits */
+        dist--;
+        code = d_code(dist);
+        put_bits(s, dcode[code], dlen[code]);
+        extra = extra_dbits[code];
+        if (extra > 0)
+            put_bits(s, dist - base_dist[code], extra);
     }
-    sprintf(outname, "%s.gz", inname);
     
-    /* Get basename for gzip header */
-    basename = strrchr(inname, '/');
-    basename = basename ? basename + 1 : inname;
+    put_bits(s, lcode[END_BLOCK], llen[END_BLOCK]);
+}
+
+/*
+ * Send a stored block, split into pieces of at most 64KB - 1
+ */
+static void send_stored(struct gz_deflate *s, unsigned char *buf, long len, int last)
+{
+    unsigned int n;
     
-    /* Open output file */
-    outfile = fopen(outname, "wb");
-    if (outfile == NULL) {
-        perror(outname);
-        free(outname);
-        fclose(infile);
-        return 1;
-    }
+    do {
+        n = (len > 65535L) ? 65535U : (unsigned int)len;
+        len -= n;
+        
+        put_bits(s, (last && len == 0) ? 1 : 0, 3);   /* BTYPE = 00 */
+        flush_bits(s);                               /* Pad to byte boundary */
+        put_byte(s, n & 0xff);
+        put_byte(s, (n >> 8) & 0xff);
+        put_byte(s, ~n & 0xff);
+        put_byte(s, (~n >> 8) & 0xff);
+        
+        /* Write the data straight from the window */
+        flush_outbuf(s);
+        if (n > 0)
+            write_out(s, buf, n);
+        buf += n;
+    } while (len > 0);
+}
+
+/*
+ * End the current block, sending it in whichever form is smallest
+ */
+static void flush_block(struct gz_deflate *s, int last)
+{
+    long stored_len, opt_bits, fixed_bits;
+    int lcodes, dcodes, blcodes, i;
     
-    printf("Compressing %s to %s...\n", inname, outname);
+    stored_len = (long)s->wpos - s->block_start;
     
-    /* Allocate buffers */
-    window = (unsigned char *)malloc((unsigned)(WSIZE * 2));
-    hash_head = (unsigned short *)malloc((unsigned)(HASH_SIZE * sizeof(unsigned short)));
-    prev = (unsigned short *)malloc((unsigned)(WSIZE * sizeof(unsigned short)));
+    /* Build the dynamic codes and the code length code that sends them */
+    build_tree(s, &s->ltree);
+    build_tree(s, &s->dtree);
+    for (lcodes = L_CODES; lcodes > 257 && s->lit_len[lcodes - 1] == 0; lcodes--)
+        ;
+    for (dcodes = D_CODES; dcodes > 1 && s->dist_len[dcodes - 1] == 0; dcodes--)
+        ;
+    scan_lengths(s, lcodes, dcodes);
+    build_tree(s, &s->bltree);
+    for (blcodes = BL_CODES; blcodes > 4 && s->bl_len[bl_order[blcodes - 1]] == 0; blcodes--)
+        ;
     
-    if (window == NULL || hash_head == NULL || prev == NULL) {
-        fprintf(stderr, "Error: Cannot allocate compression buffers\n");
-        if (window) free(window);
-        if (hash_head) free(hash_head);
-        if (prev) free(prev);
-        fclose(outfile);
-        fclose(infile);
-        free(outname);
-        return 1;
+    /* Size of each kind of block, in bits */
+    opt_bits = 3 + 5 + 5 + 4 + 3L * blcodes;
+    for (i = 0; i < s->rle_count; i++)
+        opt_bits += s->bl_len[s->rle_sym[i]] + extra_blbits[s->rle_sym[i]];
+    opt_bits += block_bits(s, s->lit_len, s->dist_len);
+    fixed_bits = 3 + block_bits(s, fixed_lit_len, fixed_dist_len);
+    
+    if (s->block_start >= 0 && (stored_len + 4) * 8 <= opt_bits &&
+        (stored_len + 4) * 8 <= fixed_bits) {
+        /* Input did not compress: send it as is */
+        send_stored(s, s->window + s->block_start, stored_len, last);
+    }
+    else if (fixed_bits <= opt_bits) {
+        put_bits(s, last | 2, 3);      /* BTYPE = 01 (fixed Huffman) */
+        compress_block(s, fixed_lit_code, fixed_lit_len, fixed_dist_code, fixed_dist_len);
+    }
+    else {
+        put_bits(s, last | 4, 3);      /* BTYPE = 10 (dynamic Huffman) */
+        send_trees(s, lcodes, dcodes, blcodes);
+        compress_block(s, s->lit_code, s->lit_len, s->dist_codes, s->dist_len);
     }
     
-    /* Initialize CRC */
-    make_crc_table();
-    crc = 0xffffffffL;
-    input_len = 0;
+    init_block(s);
+    s->block_start = s->wpos;
+}
+
+/*
+ * Check whether the STORED_PROBE bytes at p have counts as even as
+ * random data's: the sum of their squares no more than twice as far
+ * above an even spread as random data's would be on average.  No
+ * Huffman code will gain much on such bytes, though a match search
+ * still might.
+ */
+static int looks_random(unsigned char *p)
+{
+    unsigned short count[256];
+    unsigned long sum = 0;
+    unsigned int i;
     
-    /* Write gzip header */
-    write_header(basename);
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < STORED_PROBE; i++)
+        count[p[i]]++;
+    for (i = 0; i < 256; i++)
+        sum += (unsigned long)count[i] * count[i];
+    return sum <= (unsigned long)STORED_PROBE * STORED_PROBE / 256 + 2L * STORED_PROBE;
+}
+
+/*
+ * Check whether the STORED_PROBE bytes at wpos + off repeat strings of
+ * four bytes, either from the window through the level's hash table or
+ * from earlier in the probe through a small table of its own.  Ramps
+ * and repeated blocks have counts as even as random data's but match
+ * everywhere.  Every string goes in the small table but only every
+ * fourth is looked up, which still finds a repeat at any distance.
+ * Returns 1 once one string looked up in 32 repeats.
+ */
+static int has_matches(struct gz_deflate *s, unsigned int off)
+{
+    unsigned short seen[PROBE_HASH];
+    unsigned char *p = s->window + s->wpos + off;
+    unsigned int i, h, pos, cand, last;
+    unsigned int hits = 0;
     
-    /* Compress the data */
-    if (compress_data() != 0) {
-        fprintf(stderr, "Compression failed\n");
-        free(window);
-        free(hash_head);
-        free(prev);
-        fclose(outfile);
-        fclose(infile);
-        free(outname);
-        return 1;
+    memset(seen, 0xff, sizeof(seen));
+    for (i = 0; i + 4 <= STORED_PROBE; i++) {
+        h = hash4(p + i) & (PROBE_HASH - 1);
+        last = seen[h];
+        seen[h] = i;
+        if (i % 4 != 0)
+            continue;
+        pos = s->wpos + off + i;
+        cand = s->hash_head[s->level == 0 ? hash4(p + i) : hash_func(p + i)];
+        if ((cand != NIL && cand < pos && pos - cand <= MAX_DIST &&
+             s->window[cand] == p[i] &&
+             memcmp(s->window + cand, p + i, 4) == 0) ||
+            (last != 0xffff && p[last] == p[i] &&
+             memcmp(p + last, p + i, 4) == 0)) {
+            if (++hits >= STORED_PROBE / 128)
+                return 1;
+        }
     }
+    return 0;
+}
+
+/*
+ * Every STORED_PROBE bytes, check whether the next STORED_PROBE look
+ * random and find no matches.  Returns 1 if so.
+ */
+static int incompressible(struct gz_deflate *s)
+{
+    if ((long)s->wpos < s->next_probe || s->lookahead < STORED_PROBE)
+        return 0;
+    s->next_probe = (long)s->wpos + STORED_PROBE;
+    return looks_random(s->window + s->wpos) && !has_matches(s, 0);
+}
+
+/*
+ * Hash the strings starting in the n bytes at wpos + off without
+ * searching them, so that later input can still match stored bytes
+ */
+static void hash_stored(struct gz_deflate *s, unsigned int off, unsigned int n)
+{
+    unsigned int p, end, h;
+    
+    end = s->wpos + off + n;
+    if (off + n + 4 > s->lookahead)
+        end = s->wpos + s->lookahead - 3;
+    for (p = s->wpos + off; p < end; p++) {
+        if (s->level == 0)
+            s->hash_head[hash4(&s->window[p])] = p;
+        else {
+            h = hash_func(&s->window[p]);
+            s->prev[p & (WSIZE - 1)] = s->hash_head[h];
+            s->hash_head[h] = p;
+        }
+    }
+}
+
+/*
+ * Send the random-looking bytes at wpos as a stored block, unsearched,
+ * after ending any block in progress.  The block runs on through the
+ * lookahead for as long as the bytes keep passing the same checks,
+ * each piece hashed before the next is probed so that a repeat of it
+ * ends the block.
+ */
+static void store_input(struct gz_deflate *s)
+{
+    unsigned int n = STORED_PROBE;
+    
+    hash_stored(s, 0, n);
+    while (s->lookahead - n >= STORED_PROBE &&
+           looks_random(s->window + s->wpos + n) && !has_matches(s, n)) {
+        hash_stored(s, n, STORED_PROBE);
+        n += STORED_PROBE;
+    }
+    
+    if (s->last_lit > 0)
+        flush_block(s, 0);
+    send_stored(s, s->window + s->wpos, n, 0);
+    s->wpos += n;
+    s->lookahead -= n;
+    s->block_start = s->wpos;
+    s->next_probe = s->wpos;
+}
+
+/*
+ * Report progress every so often
+ */
+static void show_progress(struct gz_deflate *s)
+{
+    if (s->progress != NULL && ++s->progress_count % 100 == 0)
+        s->progress(s->total_in);
+}
+
+/*
+ * Step past n bytes already tallied, hashing the strings that start
+ * there if insert is set.  The string at the first byte is always hashed.
+ * The lookahead drops a byte at a time, so insert_string() never hashes
+ * bytes past the end of the input.
+ */
+static void skip_bytes(struct gz_deflate *s, unsigned int n, int insert)
+{
+    unsigned int i;
+    
+    for (i = 0; i < n; i++) {
+        if (i == 0 || insert)
+            insert_string(s);
+        s->wpos++;
+        s->lookahead--;
+    }
+}
+
+/*
+ * Greedy compression for the fast levels: take the best match found
+ * at each position
+ */
+static void deflate_fast(struct gz_deflate *s)
+{
+    int full;
+    
+    for (;;) {
+        /* Keep enough lookahead for a match to run to MAX_MATCH */
+        if (s->lookahead < MIN_LOOKAHEAD) {
+            fill_window(s);
+            if (s->lookahead == 0)
+                break;
+        }
+        show_progress(s);
+        if (incompressible(s)) {
+            store_input(s);
+            continue;
+        }
+        
+        /* Try to find a match */
+        s->prev_length = MIN_MATCH - 1;
+        if (find_match(s)) {
+            /* Buffer length/distance pair */
+            full = tally(s, s->wpos - s->match_start, s->match_length - MIN_MATCH);
+            
+            /* Insert the strings in the match, unless it is long */
+            skip_bytes(s, s->match_length, s->match_length <= s->max_lazy_match);
+        }
+        else {
+            /* Buffer literal */
+            full = tally(s, 0, s->window[s->wpos]);
+            skip_bytes(s, 1, 1);
+        }
+        
+        if (full)
+            flush_block(s, 0);
+    }
+}
+
+/*
+ * Level 0: probe one earlier position per 4-byte hash and take any
+ * match of 4 bytes or more.  Nothing is hashed inside matches and no
+ * chains are kept.  After every 32 misses in a row, one more byte is
+ * sent as a literal per step without being hashed, so incompressible
+ * input goes by quickly.
+ */
+static void deflate_quick(struct gz_deflate *s)
+{
+    unsigned int misses = 0;
+    unsigned int h, cur, len, max, step;
+    int full;
+    
+    for (;;) {
+        if (s->lookahead < MIN_LOOKAHEAD) {
+            fill_window(s);
+            if (s->lookahead == 0)
+                break;
+        }
+        show_progress(s);
+        if (incompressible(s)) {
+            store_input(s);
+            misses = 0;
+            continue;
+        }
+        
+        if (s->lookahead > MIN_MATCH) {
+            h = hash4(&s->window[s->wpos]);
+            cur = s->hash_head[h];
+            s->hash_head[h] = s->wpos;
+            
+            if (cur != NIL && s->wpos - cur < WSIZE) {
+                max = (s->lookahead < MAX_MATCH) ? s->lookahead : MAX_MATCH;
+                len = match_len(&s->window[s->wpos], &s->window[cur], max);
+                if (len > MIN_MATCH) {
+                    full = tally(s, s->wpos - cur, len - MIN_MATCH);
+                    s->wpos += len;
+                    s->lookahead -= len;
+                    misses = 0;
+                    if (full)
+                        flush_block(s, 0);
+                    continue;
+                }
+            }
+        }
+        
+        /* Literals, more of them the longer nothing has matched */
+        step = 1 + (misses++ >> 5);
+        if (step > s->lookahead)
+            step = s->lookahead;
+        while (step-- > 0) {
+            full = tally(s, 0, s->window[s->wpos]);
+            s->wpos++;
+            s->lookahead--;
+            if (full)
+                flush_block(s, 0);
+        }
+    }
+}
+
+/*
+ * Bits each symbol would cost with the given code lengths
+ */
+static void set_costs(struct gz_deflate *s, const unsigned char *llen,
+                      const unsigned char *dlen)
+{
+    int n, code;
+    
+    for (n = 0; n < LITERALS; n++)
+        s->lit_cost[n] = llen[n] ? llen[n] : OPT_UNUSED;
+    for (n = MIN_MATCH; n <= MAX_MATCH; n++) {
+        code = length_code[n - MIN_MATCH];
+        s->len_cost[n] = (llen[code + LITERALS + 1] ? llen[code + LITERALS + 1] :
+                          OPT_UNUSED) + extra_lbits[code];
+    }
+    for (n = 0; n < D_CODES; n++)
+        s->dist_cost[n] = (dlen[n] ? dlen[n] : OPT_UNUSED) + extra_dbits[n];
+}
+
+/*
+ * Find the cheapest way through the n bytes of the chunk under the
+ * current costs, working back from the end, then buffer it in place of
+ * the last parse
+ */
+static void parse_chunk(struct gz_deflate *s, unsigned int n, unsigned int base)
+{
+    unsigned long best, c, dc;
+    unsigned int i, k, len, lo, hi;
+    
+    s->opt_cost[n] = 0;
+    for (i = n; i-- > 0; ) {
+        best = s->lit_cost[s->opt_lit[i]] + s->opt_cost[i + 1];
+        s->opt_len[i] = 1;
+        
+        /* Each match covers the lengths the one before it does not */
+        lo = MIN_MATCH;
+        for (k = s->opt_first[i]; k < s->opt_first[i + 1]; k++) {
+            hi = (s->opt_mlen[k] < n - i) ? s->opt_mlen[k] : n - i;
+            dc = s->dist_cost[d_code(s->opt_mdist[k] - 1)];
+            for (len = lo; len <= hi; len++) {
+                c = s->len_cost[len] + dc + s->opt_cost[i + len];
+                if (c < best) {
+                    best = c;
+                    s->opt_len[i] = len;
+                    s->opt_dist[i] = s->opt_mdist[k];
+                }
+            }
+            lo = s->opt_mlen[k] + 1;
+        }
+        s->opt_cost[i] = best;
+    }
+    
+    memcpy(s->lit_freq, s->opt_lit_freq, sizeof(s->lit_freq));
+    memcpy(s->dist_freq, s->opt_dist_freq, sizeof(s->dist_freq));
+    s->last_lit = base;
+    for (i = 0; i < n; i += s->opt_len[i]) {
+        if (s->opt_len[i] == 1)
+            tally(s, 0, s->opt_lit[i]);
+        else
+            tally(s, s->opt_dist[i], s->opt_len[i] - MIN_MATCH);
+    }
+}
+
+/*
+ * Near-optimal compression: gather the matches for a chunk of input,
+ * then parse it by the fixed code costs and again by the costs of the
+ * dynamic codes each parse leads to.  After a match of nice_match or
+ * more, the positions it covers are only hashed, which keeps long runs
+ * from costing a search per byte.
+ */
+static void deflate_optimal(struct gz_deflate *s)
+{
+    unsigned int n, used, base, skip;
+    int found, pass, done = 0;
+    
+    while (!done) {
+        /* Gather a chunk, as much as the block has room for.  Matches
+         * are clipped at its end, so the next one searches from the start */
+        n = 0;
+        used = 0;
+        skip = 0;
+        base = s->last_lit;
+        while (n < LIT_BUFSIZE - base && used + OPT_CANDS <= OPT_POOL) {
+            if (s->lookahead < MIN_LOOKAHEAD) {
+                fill_window(s);
+                if (s->lookahead == 0) {
+                    done = 1;
+                    break;
+                }
+            }
+            show_progress(s);
+            
+            /* Stored stretches start a chunk, so nothing is pending */
+            if (n == 0 && incompressible(s)) {
+                store_input(s);
+                base = s->last_lit;
+                continue;
+            }
+            
+            s->opt_lit[n] = s->window[s->wpos];
+            s->opt_first[n++] = used;
+            if (skip > 0)
+                skip--;
+            else {
+                found = find_matches(s, s->opt_mlen + used, s->opt_mdist + used);
+                used += found;
+                if (found > 0 && s->opt_mlen[used - 1] >= s->nice_match)
+                    skip = s->opt_mlen[used - 1] - 1;
+            }
+            insert_string(s);
+            s->wpos++;
+            s->lookahead--;
+        }
+        if (n == 0)
+            break;
+        s->opt_first[n] = used;
+        
+        /* Parse it, each time by the costs of the last parse's codes */
+        memcpy(s->opt_lit_freq, s->lit_freq, sizeof(s->lit_freq));
+        memcpy(s->opt_dist_freq, s->dist_freq, sizeof(s->dist_freq));
+        set_costs(s, fixed_lit_len, fixed_dist_len);
+        for (pass = 1; pass < OPT_PASSES; pass++) {
+            parse_chunk(s, n, base);
+            build_tree(s, &s->ltree);
+            build_tree(s, &s->dtree);
+            set_costs(s, s->lit_len, s->dist_len);
+        }
+        parse_chunk(s, n, base);
+        
+        /* The last block is sent by the caller */
+        if (!done && s->last_lit > LIT_BUFSIZE - LIT_BUFSIZE / 4)
+            flush_block(s, 0);
+    }
+}
+
+/*
+ * Lazy compression: a match is only sent if the next position does
+ * not start a longer one; otherwise its first byte goes as a literal
+ */
+static void deflate_slow(struct gz_deflate *s)
+{
+    unsigned int prev_dist, match_dist = 0;
+    int match_available = 0;
+    
+    s->match_length = MIN_MATCH - 1;
+    for (;;) {
+        /* Keep enough lookahead for a match to run to MAX_MATCH */
+        if (s->lookahead < MIN_LOOKAHEAD) {
+            fill_window(s);
+            if (s->lookahead == 0)
+                break;
+        }
+        show_progress(s);
+        
+        /* Not while a match waits on the lazy search; a literal held
+         * back goes before the stored block */
+        if (s->match_length < MIN_MATCH && incompressible(s)) {
+            if (match_available)
+                tally(s, 0, s->window[s->wpos - 1]);
+            match_available = 0;
+            store_input(s);
+            continue;
+        }
+        
+        /* Keep distances rather than positions: the window may slide
+         * before the previous match is sent */
+        s->prev_length = s->match_length;
+        prev_dist = match_dist;
+        s->match_length = MIN_MATCH - 1;
+        
+        if (s->prev_length < s->max_lazy_match && find_match(s)) {
+            match_dist = s->wpos - s->match_start;
+            if (s->match_length == MIN_MATCH && match_dist > TOO_FAR) {
+                /* Short and far away: cheaper as literals */
+                s->match_length = MIN_MATCH - 1;
+            }
+        }
+        
+        if (s->prev_length >= MIN_MATCH && s->match_length <= s->prev_length) {
+            /* The match from the previous byte is at least as long: send
+             * it, then insert the strings for the rest of it */
+            if (tally(s, prev_dist, s->prev_length - MIN_MATCH)) {
+                skip_bytes(s, s->prev_length - 1, 1);
+                flush_block(s, 0);
+            }
+            else
+                skip_bytes(s, s->prev_length - 1, 1);
+            match_available = 0;
+            s->match_length = MIN_MATCH - 1;
+        }
+        else if (match_available) {
+            /* No better match here: the previous byte is a literal */
+            if (tally(s, 0, s->window[s->wpos - 1]))
+                flush_block(s, 0);
+            skip_bytes(s, 1, 1);
+        }
+        else {
+            /* Wait a byte to see if a longer match follows */
+            match_available = 1;
+            skip_bytes(s, 1, 1);
+        }
+    }
+    
+    if (match_available)
+        tally(s, 0, s->window[s->wpos - 1]);
+}
+
+/*
+ * Start with an empty window, hash table and block
+ */
+static void init_window(struct gz_deflate *s)
+{
+    unsigned int i;
+    
+#ifdef USE_MMAP
+    if (s->map_base != NULL)
+        s->window = s->map_next;
+#endif
     
-    /* Flush output bits */
-    flush_bits();
+    for (i = 0; i < HASH_SIZE; i++)
+        s->hash_head[i] = NIL;
+    for (i = 0; i < WSIZE; i++)
+        s->prev[i] = NIL;
+    
+    s->wpos = 0;
+    s->lookahead = 0;
+    s->block_start = 0;
+    s->next_probe = 0;
+    s->match_start = 0;
+    init_block(s);
+}
+
+/*
+ * Run the compressor for the level over the input
+ */
+static void deflate_input(struct gz_deflate *s)
+{
+    if (s->level == 0)
+        deflate_quick(s);
+    else if (s->level == OPTIMAL_LEVEL)
+        deflate_optimal(s);
+    else if (config_table[s->level].lazy)
+        deflate_slow(s);
+    else
+        deflate_fast(s);
+}
+
+/*
+ * End a gzip member and start the next, which begins with no history
+ */
+static void next_member(struct gz_deflate *s)
+{
+    write_trailer(s);
+    write_header(s, s->header_name);
+    flush_outbuf(s);
+    s->crc = 0xffffffffL;
+    s->input_len = 0;
+}
+
+/*
+ * Check whether any input remains
+ */
+static int more_input(struct gz_deflate *s)
+{
+    unsigned char c;
+    int n;
+    
+#ifdef USE_MMAP
+    if (s->map_base != NULL)
+        return s->map_next < s->map_end;
+#endif
+    if (s->held < 0 && !s->failed) {
+        n = s->read(s->read_arg, &c, 1);
+        if (n < 0)
+            s->failed = 1;
+        if (n > 0)
+            s->held = c;
+    }
+    return s->held >= 0;
+}
+
+/*
+ * Start a gzip stream: clear the stream state and write the header
+ */
+static void start_stream(struct gz_deflate *s)
+{
+    s->bitbuf = 0;
+    s->bitcount = 0;
+    s->outcnt = 0;
+    s->bytes_out = 0;
+    s->crc = 0xffffffffL;
+    s->input_len = 0;
+    s->total_in = 0;
+    s->in_left = -1;
+    s->held = -1;
+    s->failed = 0;
+    s->progress_count = 0;
+    
+    write_header(s, s->header_name);
+}
+
+/*
+ * Compress the input, as one member or one per member_size bytes
+ */
+static void deflate_members(struct gz_deflate *s)
+{
+    for (;;) {
+        init_window(s);
+        if (s->member_size > 0)
+            s->in_left = s->member_size;
+    
+        /* Compress the data */
+        deflate_input(s);
+    
+        /* Send the last block */
+        flush_block(s, 1);
+    
+        /* Pad to byte boundary */
+        flush_bits(s);
+    
+        if (s->member_size == 0 || !more_input(s))
+            break;
+        next_member(s);
+    }
+}
+
+/*
+ * Free the near-optimal parsing buffers, leaving their pointers NULL
+ */
+static void free_optimal(struct gz_deflate *s)
+{
+    if (s->opt_lit) free(s->opt_lit);
+    if (s->opt_first) free(s->opt_first);
+    if (s->opt_mlen) free(s->opt_mlen);
+    if (s->opt_mdist) free(s->opt_mdist);
+    if (s->opt_cost) free(s->opt_cost);
+    if (s->opt_len) free(s->opt_len);
+    if (s->opt_dist) free(s->opt_dist);
+    s->opt_lit = NULL;
+    s->opt_first = NULL;
+    s->opt_mlen = NULL;
+    s->opt_mdist = NULL;
+    s->opt_cost = NULL;
+    s->opt_len = NULL;
+    s->opt_dist = NULL;
+}
+
+/*
+ * Set the compression level for the streams that follow and forget any
+ * other settings.  Returns -1 if the level is not 0 to 10, or if
+ * memory for level 10 runs out, leaving the context as it was.
+ */
+int gz_deflate_reset(struct gz_deflate *s, int level)
+{
+    if (level < 0 || level > OPTIMAL_LEVEL)
+        return -1;
+    
+    /* Space for near-optimal parsing, kept once allocated.  The level
+     * only changes once all of it is there. */
+    if (level == OPTIMAL_LEVEL && s->opt_lit == NULL) {
+        s->opt_lit = (unsigned char *)malloc((unsigned)LIT_BUFSIZE);
+        s->opt_first = (unsigned int *)malloc((unsigned)((LIT_BUFSIZE + 1) * sizeof(unsigned int)));
+        s->opt_mlen = (unsigned short *)malloc((unsigned)(OPT_POOL * sizeof(unsigned short)));
+        s->opt_mdist = (unsigned short *)malloc((unsigned)(OPT_POOL * sizeof(unsigned short)));
+        s->opt_cost = (unsigned long *)malloc((unsigned)((LIT_BUFSIZE + 1) * sizeof(unsigned long)));
+        s->opt_len = (unsigned short *)malloc((unsigned)(LIT_BUFSIZE * sizeof(unsigned short)));
+        s->opt_dist = (unsigned short *)malloc((unsigned)(LIT_BUFSIZE * sizeof(unsigned short)));
+        if (s->opt_lit == NULL || s->opt_first == NULL || s->opt_mlen == NULL ||
+            s->opt_mdist == NULL || s->opt_cost == NULL || s->opt_len == NULL ||
+            s->opt_dist == NULL) {
+            free_optimal(s);
+            return -1;
+        }
+    }
+    
+    s->level = level;
+    s->good_match = config_table[level].good_length;
+    s->max_lazy_match = config_table[level].max_lazy;
+    s->nice_match = config_table[level].nice_length;
+    s->max_chain_length = config_table[level].max_chain;
+    s->member_size = 0;
+    s->header_name = NULL;
+    s->progress = NULL;
+    return 0;
+}
+
+/*
+ * Free a compression context and its buffers
+ */
+void gz_deflate_free(struct gz_deflate *s)
+{
+    if (s == NULL)
+        return;
+    if (s->window) free(s->window);
+    if (s->hash_head) free(s->hash_head);
+    if (s->prev) free(s->prev);
+    if (s->l_buf) free(s->l_buf);
+    if (s->d_buf) free(s->d_buf);
+    if (s->outbuf) free(s->outbuf);
+    free_optimal(s);
+    free(s);
+}
+
+/*
+ * Allocate a compression context for the level.  Returns NULL if memory
+ * runs out or the level is not 0 to 10.
+ */
+struct gz_deflate *gz_deflate_init(int level)
+{
+    struct gz_deflate *s;
+    
+    s = (struct gz_deflate *)calloc(1, sizeof(struct gz_deflate));
+    if (s == NULL)
+        return NULL;
+    
+    /* Allocate buffers */
+    s->window = (unsigned char *)malloc((unsigned)(WSIZE * 2 + WINDOW_SLACK));
+    s->hash_head = (Pos *)malloc((unsigned)(HASH_SIZE * sizeof(Pos)));
+    s->prev = (Pos *)malloc((unsigned)(WSIZE * sizeof(Pos)));
+    s->l_buf = (unsigned char *)malloc((unsigned)LIT_BUFSIZE);
+    s->d_buf = (unsigned short *)malloc((unsigned)(LIT_BUFSIZE * sizeof(unsigned short)));
+    s->outbuf = (unsigned char *)malloc((unsigned)OUTBUFSIZ);
+    
+    if (s->window == NULL || s->hash_head == NULL || s->prev == NULL ||
+        s->l_buf == NULL || s->d_buf == NULL || s->outbuf == NULL ||
+        gz_deflate_reset(s, level) != 0) {
+        gz_deflate_free(s);
+        return NULL;
+    }
+    
+    s->ltree.freq = s->lit_freq;
+    s->ltree.len = s->lit_len;
+    s->ltree.code = s->lit_code;
+    s->ltree.elems = L_CODES;
+    s->ltree.max_bits = MAX_BITS;
+    s->dtree.freq = s->dist_freq;
+    s->dtree.len = s->dist_len;
+    s->dtree.code = s->dist_codes;
+    s->dtree.elems = D_CODES;
+    s->dtree.max_bits = MAX_BITS;
+    s->bltree.freq = s->bl_freq;
+    s->bltree.len = s->bl_len;
+    s->bltree.code = s->bl_codes;
+    s->bltree.elems = BL_CODES;
+    s->bltree.max_bits = MAX_BL_BITS;
+    return s;
+}
+
+/*
+ * Compress everything read through the read callback into one gzip
+ * member written through the write callback.  Returns -1 if either
+ * callback fails.
+ */
+int gz_deflate_stream(struct gz_deflate *s, gz_read_func reader, void *read_arg,
+                      gz_write_func writer, void *write_arg)
+{
+    s->read = reader;
+    s->read_arg = read_arg;
+    s->write = writer;
+    s->write_arg = write_arg;
     
-    /* Flush stdio buffer to ensure bit output is complete */
+    start_stream(s);
+    deflate_members(s);
+    write_trailer(s);
+    return s->failed ? -1 : 0;
+}
+
+/* A memory buffer read or written through the stream callbacks */
+struct membuf {
+    unsigned char *next;
+    long left;
+};
+
+static int read_mem(void *arg, unsigned char *buf, unsigned int len)
+{
+    struct membuf *m = (struct membuf *)arg;
+    
+    if ((long)len > m->left)
+        len = (unsigned int)m->left;
+    memcpy(buf, m->next, len);
+    m->next += len;
+    m->left -= len;
+    return (int)len;
+}
+
+static int write_mem(void *arg, unsigned char *buf, unsigned int len)
+{
+    struct membuf *m = (struct membuf *)arg;
+    
+    if ((long)len > m->left)
+        return -1;
+    memcpy(m->next, buf, len);
+    m->next += len;
+    m->left -= len;
+    return 0;
+}
+
+/*
+ * Compress srclen bytes at src into a gzip member at dst.  Returns its
+ * length, or -1 if it does not fit in dstlen bytes.
+ */
+long gz_deflate_buffer(struct gz_deflate *s, unsigned char *src, long srclen,
+                       unsigned char *dst, long dstlen)
+{
+    struct membuf in, out;
+    
+    in.next = src;
+    in.left = srclen;
+    out.next = dst;
+    out.left = dstlen;
+    if (gz_deflate_stream(s, read_mem, &in, write_mem, &out) != 0)
+        return -1;
+    return dstlen - out.left;
+}
+
+#ifndef GZ_LIBRARY
+/*
+ * The gzip command, on top of a single compression context
+ */
+
+static FILE *infile = NULL;
+static FILE *outfile = NULL;
+
+/* Input size for progress reporting */
+static long file_size = 0;
+
+/* Options that apply to every file */
+static int to_stdout = 0;
+static int recursive = 0;
+static int quiet = 0;           /* No progress lines */
+
+/* Batch mode: with -P, process batch_index of batch_workers takes
+ * every batch_workers-th file of the nfiles seen */
+static int batch_workers = 1;
+static int batch_index = 0;
+static long nfiles = 0;
+
+static int read_file(void *arg, unsigned char *buf, unsigned int len)
+{
+    FILE *fp = (FILE *)arg;
+    int n;
+    
+    n = fread(buf, 1, len, fp);
+    return (n == 0 && ferror(fp)) ? -1 : n;
+}
+
+static int write_file(void *arg, unsigned char *buf, unsigned int len)
+{
+    return (fwrite(buf, 1, len, (FILE *)arg) == len) ? 0 : -1;
+}
+
+/*
+ * Report how much of the input has been compressed, as a percentage
+ * if its size is known
+ */
+static void report_progress(unsigned long done)
+{
+    if (quiet)
+        return;
+    if (file_size > 0) {
+        fprintf(stderr, "\rCompressing: %d%% (%lu/%ld bytes)",
+                (int)((done * 100L) / file_size),
+                done, file_size);
+    }
+    else if (file_size < 0)
+        fprintf(stderr, "\rCompressing: %lu bytes", done);
+}
+
+#ifdef USE_MMAP
+/*
+ * Map the input when it is a whole regular file.  A page of zeros
+ * follows the file, since matching may read a little past the end of
+ * the input.  Input that cannot be mapped is read through stdio.
+ */
+static void map_input(struct gz_deflate *s, long start)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char *p;
+    size_t len;
+    
+    if (start != 0 || file_size <= 0 || page <= 0)
+        return;
+    len = ((size_t)file_size + page - 1) / page * page + page;
+    p = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return;
+    if (mmap(p, (size_t)file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+             fileno(infile), 0) == MAP_FAILED) {
+        munmap(p, len);
+        return;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(p, (size_t)file_size, MADV_SEQUENTIAL);
+#endif
+    
+    s->map_base = s->map_next = p;
+    s->map_end = p + file_size;
+    s->map_len = len;
+    s->window_buf = s->window;
+}
+
+/*
+ * Drop the mapping and go back to the window buffer
+ */
+static void unmap_input(struct gz_deflate *s)
+{
+    if (s->map_base == NULL)
+        return;
+    munmap(s->map_base, s->map_len);
+    s->map_base = NULL;
+    s->window = s->window_buf;
+}
+#endif
+
+/*
+ * Compress the data, as one member or one per member_size bytes
+ */
+static int compress_data(struct gz_deflate *s)
+{
+    long start;
+    
+    /* Get file size for progress reporting, or -1 if it cannot seek */
+    file_size = -1;
+    start = ftell(infile);
+    if (start >= 0 && fseek(infile, 0L, 2) == 0) {  /* SEEK_END */
+        file_size = ftell(infile) - start;
+        fseek(infile, start, 0);  /* SEEK_SET */
+    }
+#ifdef USE_MMAP
+    map_input(s, start);
+#endif
+    
+    deflate_members(s);
+    
+#ifdef USE_MMAP
+    unmap_input(s);
+#endif
+    
+    /* Clear progress line */
+    if (quiet)
+        ;
+    else if (file_size < 0)
+        fprintf(stderr, "\rCompressing: %lu bytes\n", s->total_in);
+    else
+        fprintf(stderr, "\rCompressing: 100%% (%ld/%ld bytes)\n",
+                file_size, file_size);
+    
+    return s->failed ? 1 : 0;
+}
+
+/*
+ * Worker side of parallel mode: compress len bytes at offset of the
+ * named file to fd, primed with the WSIZE bytes before offset unless
+ * the chunk starts a member.  Chunks that do not end a member end with
+ * an empty stored block (a sync flush) so the chunks join into one
+ * deflate stream.  The chunk's CRC follows the compressed data.
+ * Returns the exit status for the worker.
+ */
+static int compress_chunk(struct gz_deflate *s, char *inname, long offset, long len,
+                          int first, int last, int fd)
+{
+    unsigned int dict, p, h;
+    unsigned long c;
+    int i;
+    
+    infile = fopen(inname, "rb");
+    outfile = fdopen(fd, "wb");
+    if (infile == NULL || outfile == NULL)
+        return 1;
+    s->read_arg = infile;
+    s->write_arg = outfile;
+    
+    /* Load the dictionary and hash its strings */
+    init_window(s);
+    dict = (offset > (long)WSIZE) ? WSIZE : (unsigned int)offset;
+    if (first)
+        dict = 0;
+    if (fseek(infile, offset - dict, 0) != 0 ||
+        fread(s->window, 1, dict, infile) != dict)
+        return 1;
+    if (s->level == 0) {
+        /* deflate_quick() probes only its 4-byte hash, without chains */
+        for (p = 1; p + 4 <= dict; p++)
+            s->hash_head[hash4(&s->window[p])] = p;
+    }
+    else {
+        for (p = 1; p + MIN_MATCH <= dict; p++) {
+            h = hash_func(&s->window[p]);
+            s->prev[p & (WSIZE - 1)] = s->hash_head[h];
+            s->hash_head[h] = p;
+        }
+    }
+    s->wpos = dict;
+    s->block_start = dict;
+    
+    /* Compress the chunk quietly */
+    s->progress = NULL;
+    s->in_left = len;
+    deflate_input(s);
+    
+    if (last) {
+        flush_block(s, 1);
+    }
+    else {
+        flush_block(s, 0);
+        send_stored(s, s->window + s->wpos, 0L, 0);
+    }
+    flush_bits(s);
+    
+    c = s->crc ^ 0xffffffffL;
+    for (i = 0; i < 4; i++)
+        put_byte(s, (int)((c >> (i * 8)) & 0xff));
+    flush_outbuf(s);
+    
+    if (s->input_len != (unsigned long)len || s->failed || fclose(outfile) != 0)
+        return 1;
+    return 0;
+}
+
+/*
+ * Copy a worker's output to the output file, all but the four CRC bytes
+ * at the end.  Returns -1 if the output is cut short.
+ */
+static int collect_chunk(struct gz_deflate *s, int fd, unsigned long *chunk_crc)
+{
+    unsigned char buf[BUFSIZ + 4];
+    int have = 0;
+    int n;
+    
+    while ((n = read(fd, buf + have, BUFSIZ)) > 0) {
+        have += n;
+        if (have > 4) {
+            write_out(s, buf, have - 4);
+            memmove(buf, buf + have - 4, 4);
+            have = 4;
+        }
+    }
+    
+    if (n < 0 || have != 4)
+        return -1;
+    
+    *chunk_crc = (unsigned long)buf[0] | ((unsigned long)buf[1] << 8) |
+                 ((unsigned long)buf[2] << 16) | ((unsigned long)buf[3] << 24);
+    return 0;
+}
+
+/*
+ * Compress the data with up to nworkers processes, each compressing one
+ * CHUNK_SIZE piece of the input.  Output is collected in order and the
+ * chunk CRCs combined, giving the same gzip members as serial
+ * compression with sync flushes at the chunk boundaries.  Members are
+ * rounded up to a whole number of chunks.
+ */
+static int compress_parallel(struct gz_deflate *s, char *inname, int nworkers)
+{
+    int fds[MAX_WORKERS];
+    pid_t pids[MAX_WORKERS];
+    long nchunks, per_member, next, k;
+    long offset, len, member_len = 0;
+    unsigned long member_crc = 0, chunk_crc;
+    int pfd[2];
+    int slot, status, failed = 0;
+    
+    /* Get file size to split the input */
+    fseek(infile, 0L, 2);  /* SEEK_END */
+    file_size = ftell(infile);
+    fseek(infile, 0L, 0);  /* SEEK_SET */
+    
+    nchunks = (file_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (nchunks < 2)
+        return compress_data(s);
+    per_member = nchunks;
+    if (s->member_size > 0)
+        per_member = (s->member_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    
+    /* Workers must not inherit unwritten output */
+    flush_outbuf(s);
     fflush(outfile);
+    fflush(stdout);
+    fflush(stderr);
     
-    /* Write gzip trailer */
-    write_trailer();
+    next = 0;
+    for (k = 0; k < nchunks && !failed; k++) {
+        /* Keep nworkers chunks in progress */
+        while (next < nchunks && next < k + nworkers) {
+            slot = (int)(next % nworkers);
+            offset = next * CHUNK_SIZE;
+            len = (next == nchunks - 1) ? file_size - offset : CHUNK_SIZE;
+    
+            if (pipe(pfd) < 0) {
+                perror("pipe");
+                failed = 1;
+                break;
+            }
+            pids[slot] = fork();
+            if (pids[slot] < 0) {
+                perror("fork");
+                close(pfd[0]);
+                close(pfd[1]);
+                failed = 1;
+                break;
+            }
+            if (pids[slot] == 0) {
+                close(pfd[0]);
+                _exit(compress_chunk(s, inname, offset, len,
+                                     next % per_member == 0,
+                                     next % per_member == per_member - 1 ||
+                                     next == nchunks - 1, pfd[1]));
+            }
+            close(pfd[1]);
+            fds[slot] = pfd[0];
+            next++;
+        }
+        if (k == next)
+            break;
+    
+        /* Collect the oldest chunk */
+        slot = (int)(k % nworkers);
+        if (collect_chunk(s, fds[slot], &chunk_crc) < 0)
+            failed = 1;
+        close(fds[slot]);
+        if (waitpid(pids[slot], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+    
+        len = (k == nchunks - 1) ? file_size - k * CHUNK_SIZE : CHUNK_SIZE;
+        member_crc = crc32_combine(member_crc, chunk_crc, len);
+        member_len += len;
+        report_progress((unsigned long)(k * CHUNK_SIZE + len));
+    
+        /* Close the member after its last chunk */
+        if (!failed && k % per_member == per_member - 1 && k != nchunks - 1) {
+            s->crc = member_crc ^ 0xffffffffL;
+            s->input_len = (unsigned long)member_len;
+            next_member(s);
+            member_crc = 0;
+            member_len = 0;
+        }
+    }
+    
+    /* Reap any workers left after a failure */
+    for (; k < next; k++) {
+        slot = (int)(k % nworkers);
+        close(fds[slot]);
+        waitpid(pids[slot], &status, 0);
+    }
+    
+    if (failed || s->failed)
+        return 1;
+    
+    s->crc = member_crc ^ 0xffffffffL;
+    s->input_len = (unsigned long)member_len;
+    s->total_in = (unsigned long)file_size;
+    
+    /* Clear progress line */
+    if (!quiet)
+        fprintf(stderr, "\rCompressing: 100%% (%ld/%ld bytes)\n", file_size, file_size);
     
-    printf("Compressed %lu bytes to %ld bytes\n", 
-           input_len, ftell(outfile));
+    return 0;
+}
+
+/*
+ * Compress one file with the context, to <file>.gz or standard output.
+ * Returns nonzero on failure.
+ */
+static int compress_file(struct gz_deflate *s, char *inname, int nworkers)
+{
+    char *outname = NULL;
+    char *basename = NULL;
+    FILE *msg;
+    int status;
+    
+    /* Open input file; standard input has no name to record and
+     * cannot be read by parallel workers */
+    if (strcmp(inname, "-") == 0) {
+        infile = stdin;
+        nworkers = 1;
+    }
+    else {
+        infile = fopen(inname, "rb");
+        if (infile == NULL) {
+            perror(inname);
+            return 1;
+        }
+    
+        /* Get basename for gzip header */
+        basename = strrchr(inname, '/');
+        basename = basename ? basename + 1 : inname;
+    }
+    
+    /* Open output file, keeping standard output for the data */
+    if (to_stdout || infile == stdin) {
+        if (isatty(fileno(stdout))) {
+            fprintf(stderr, "Compressed data not written to a terminal\n");
+            if (infile != stdin)
+                fclose(infile);
+            return 1;
+        }
+        outfile = stdout;
+        msg = stderr;
+        fprintf(msg, "Compressing %s to standard output...\n",
+                basename ? inname : "standard input");
+    }
+    else {
+        /* Create output filename */
+        outname = malloc(strlen(inname) + 4);
+        if (outname == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            fclose(infile);
+            return 1;
+        }
+        sprintf(outname, "%s.gz", inname);
+    
+        outfile = fopen(outname, "wb");
+        if (outfile == NULL) {
+            perror(outname);
+            free(outname);
+            fclose(infile);
+            return 1;
+        }
+        msg = stdout;
+        fprintf(msg, "Compressing %s to %s...\n", inname, outname);
+    }
+    
+    /* Write gzip header */
+    s->header_name = basename;
+    s->read_arg = infile;
+    s->write_arg = outfile;
+    start_stream(s);
+    
+    /* Compress the data */
+    if (nworkers > 1)
+        status = compress_parallel(s, inname, nworkers);
+    else
+        status = compress_data(s);
+    
+    /* Write gzip trailer */
+    if (status == 0) {
+        write_trailer(s);
+        if (s->failed || fflush(outfile) != 0)
+            status = 1;
+    }
+    if (status != 0)
+        fprintf(stderr, "Compression failed\n");
+    else
+        fprintf(msg, "Compressed %lu bytes to %lu bytes\n",
+                s->total_in, s->bytes_out);
     
     /* Cleanup */
-    free(window);
-    free(hash_head);
-    free(prev);
-    fclose(outfile);
-    fclose(infile);
+    if (outfile != stdout)
+        fclose(outfile);
+    if (infile != stdin)
+        fclose(infile);
     free(outname);
+    return status;
+}
+
+/*
+ * Compress a file, or with -r everything under a directory.  Files
+ * found in directories that already end in .gz are left alone, as are
+ * links and special files.  Returns nonzero if any file fails.
+ */
+static int compress_path(struct gz_deflate *s, char *path, int nworkers, int top)
+{
+    struct stat st;
+    struct dirent *d;
+    DIR *dir;
+    char *sub;
+    int len, status = 0;
     
-    return 0;
+    if (strcmp(path, "-") != 0) {
+        if ((top ? stat(path, &st) : lstat(path, &st)) != 0) {
+            perror(path);
+            return 1;
+        }
+        if ((st.st_mode & S_IFMT) == S_IFDIR) {
+            if (!recursive) {
+                fprintf(stderr, "%s is a directory (use -r)\n", path);
+                return 1;
+            }
+            dir = opendir(path);
+            if (dir == NULL) {
+                perror(path);
+                return 1;
+            }
+            while ((d = readdir(dir)) != NULL) {
+                if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                    continue;
+                sub = malloc(strlen(path) + strlen(d->d_name) + 2);
+                if (sub == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    status = 1;
+                    break;
+                }
+                sprintf(sub, "%s/%s", path, d->d_name);
+                status |= compress_path(s, sub, nworkers, 0);
+                free(sub);
+            }
+            closedir(dir);
+            return status;
+        }
+        if (!top) {
+            len = strlen(path);
+            if ((st.st_mode & S_IFMT) != S_IFREG ||
+                (len > 3 && strcmp(path + len - 3, ".gz") == 0))
+                return 0;
+        }
+    }
+    
+    /* With -P, take only this process's share */
+    if (nfiles++ % batch_workers != batch_index)
+        return 0;
+    return compress_file(s, path, nworkers);
+}
+
+/*
+ * Print usage message
+ */
+static void usage(char *progname)
+{
+    fprintf(stderr, "Usage: %s [-0..-10] [-c] [-r] [-p workers] [-P workers] [-m member-KB] [<file>... | -]\n",
+            progname);
+    fprintf(stderr, "  -0 compresses fastest, without hash chains; -10 best; default is -%d\n",
+            DEFAULT_LEVEL);
+    fprintf(stderr, "  -c writes to standard output; - or no file reads standard input\n");
+    fprintf(stderr, "  -r compresses the files under each directory\n");
+    fprintf(stderr, "  -p compresses %ldKB chunks in parallel processes\n",
+            CHUNK_SIZE / 1024);
+    fprintf(stderr, "  -P compresses that many files at once in separate processes\n");
+    fprintf(stderr, "  -m starts a new gzip member every member-KB of input\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct gz_deflate *s;
+    static char *std_input[] = { "-" };
+    char **names;
+    int nnames;
+    pid_t pids[MAX_WORKERS];
+    int argn, k, n;
+    int level = DEFAULT_LEVEL;
+    long member_size = 0;
+    int nworkers = 1;
+    int status = 0;
+    
+    /* Compression level and worker flags */
+    for (argn = 1; argn < argc && argv[argn][0] == '-' && argv[argn][1]; argn++) {
+        if (argv[argn][1] >= '0' && argv[argn][1] <= '9' &&
+            argv[argn][2] == '\0') {
+            level = argv[argn][1] - '0';
+        }
+        else if (strcmp(argv[argn], "-10") == 0)
+            level = OPTIMAL_LEVEL;
+        else if (strcmp(argv[argn], "-c") == 0)
+            to_stdout = 1;
+        else if (strcmp(argv[argn], "-r") == 0)
+            recursive = 1;
+        else if (strcmp(argv[argn], "-m") == 0 && argn + 1 < argc) {
+            member_size = atol(argv[++argn]) * 1024L;
+            if (member_size <= 0) {
+                fprintf(stderr, "Member size must be at least 1KB\n");
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[argn], "-p") == 0 || strcmp(argv[argn], "-P") == 0) &&
+                 argn + 1 < argc) {
+            n = atoi(argv[argn + 1]);
+            if (n < 1 || n > MAX_WORKERS) {
+                fprintf(stderr, "Workers must be 1 to %d\n", MAX_WORKERS);
+                return 1;
+            }
+            if (argv[argn][1] == 'p')
+                nworkers = n;
+            else
+                batch_workers = n;
+            argn++;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    /* Files compressed at once would mix on standard output */
+    if (to_stdout && batch_workers > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    names = (argn < argc) ? argv + argn : std_input;
+    nnames = (argn < argc) ? argc - argn : 1;
+    
+    /* One context serves every file this process compresses */
+    s = gz_deflate_init(level);
+    if (s == NULL) {
+        fprintf(stderr, "Error: Cannot allocate compression buffers\n");
+        return 1;
+    }
+    s->member_size = member_size;
+    s->progress = report_progress;
+    s->read = read_file;
+    s->write = write_file;
+    
+    if (batch_workers == 1) {
+        for (k = 0; k < nnames; k++)
+            status |= compress_path(s, names[k], nworkers, 1);
+    }
+    else {
+        /* Each process walks the same names and takes its share, so the
+         * progress lines would garble */
+        quiet = 1;
+        s->progress = NULL;
+        fflush(stdout);
+        fflush(stderr);
+        for (n = 0; n < batch_workers; n++) {
+            pids[n] = fork();
+            if (pids[n] < 0) {
+                perror("fork");
+                status = 1;
+                break;
+            }
+            if (pids[n] == 0) {
+                batch_index = n;
+                for (k = 0; k < nnames; k++)
+                    status |= compress_path(s, names[k], nworkers, 1);
+                fflush(stdout);
+                _exit(status != 0);
+            }
+        }
+        while (n-- > 0) {
+            if (waitpid(pids[n], &k, 0) != pids[n] ||
+                !WIFEXITED(k) || WEXITSTATUS(k) != 0)
+                status = 1;
+        }
+    }
+    
+    gz_deflate_free(s);
+    return status != 0;
 }
+#endif /* GZ_LIBRARY */